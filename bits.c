@@ -155,19 +155,19 @@ send_bits (int value, int length)
 }
 
 /* ===========================================================================
- * Reverse the first LEN bits of CODE, using straightforward code (a faster
- * method would use a table)
- * IN assertion: 1 <= LEN <= 15
+ * Reverse the first LEN bits of CODE, a byte at a time with a table.
+ * IN assertion: 1 <= LEN <= 16
  */
+#define R2(n) n, n + 2*64, n + 1*64, n + 3*64
+#define R4(n) R2(n), R2(n + 2*16), R2(n + 1*16), R2(n + 3*16)
+#define R6(n) R4(n), R4(n + 2*4), R4(n + 1*4), R4(n + 3*4)
+static uch const byte_rev[256] = { R6(0), R6(2), R6(1), R6(3) };
+
 unsigned
 bi_reverse (unsigned code, int len)
 {
-    register unsigned res = 0;
-    do {
-        res |= code & 1;
-        code >>= 1, res <<= 1;
-    } while (--len > 0);
-    return res >> 1;
+    return ((byte_rev[code & 0xff] << 8) | byte_rev[(code >> 8) & 0xff])
+           >> (16 - len);
 }
 
 /* ===========================================================================
@@ -0,0 +1,326 @@
+/* cache.c -- content-addressed cache of compressed data for gzip
+
+   Copyright (C) 2025 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* With --cache-dir=DIR, the compressed data of a member (the deflate
+ * stream and the CRC and size trailer, but not the header) is kept in
+ * DIR under the SHA-256 of the uncompressed data and of everything else
+ * that determines those bytes: the gzip version, the level and
+ * --rsyncable.  The header is always written afresh, so the file name
+ * and timestamp options work as usual.
+ *
+ * Only regular, seekable input files are looked up: the input is hashed
+ * in a first pass, and compressed in a second one on a miss.  Only
+ * output files created by gzip are added to the cache, by copying their
+ * body back out of them (which may share the data blocks, on file
+ * systems that support it).  An entry is inflated and checked against
+ * the input before it is used, and removed if it does not match; the
+ * input is then compressed as on a miss.  Problems with the cache are
+ * reported but never cause the compression itself to fail.  DIR is
+ * created if need be, but not its parents.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "tailor.h"
+#include "gzip.h"
+#include "sha256.h"
+#include "version.h"
+
+#ifndef MAX_PATH_LEN
+#  define MAX_PATH_LEN   1024 /* max pathname length */
+#endif
+
+char *cache_dir;            /* --cache-dir, or NULL */
+
+static char cache_name[MAX_PATH_LEN]; /* cache file for the current input */
+static bool cache_pending;  /* the current output should be stored */
+static off_t cache_len;     /* length of the hashed input */
+static ulg cache_crc;       /* and its CRC */
+
+/* Report a problem with the cache without changing the exit status.  */
+static void
+cache_warning (char const *name)
+{
+  if (!quiet)
+    fprintf (stderr, "%s: %s: %s -- cache not used\n",
+             program_name, name, strerror (errno));
+}
+
+/* ===========================================================================
+ * Return true if FD, a cache file of SIZE bytes, holds a deflate stream
+ * that inflates to the hashed input, followed by its crc and length.
+ * Leave the buffers cleared.
+ */
+static bool
+cache_check (int fd, off_t size)
+{
+  uch trailer[8];
+  int saved_ifd = ifd;
+  int saved_test = test;
+  off_t saved_offset = in_offset;
+  bool ok;
+
+  if (size < 8 || pread (fd, trailer, 8, size - 8) != 8
+      || LG (trailer) != cache_crc
+      || LG (trailer + 4) != (ulg) (cache_len & 0xffffffff))
+    return false;
+
+  /* inbuf and window are not in use yet.  Inflate without output.  */
+  ifd = fd;
+  test = 1;
+  in_offset = -1;
+  clear_bufs ();
+  updcrc (NULL, 0);
+  ok = (gzip_inflate () == 0
+        && getcrc () == cache_crc && bytes_out == cache_len
+        && bytes_in - (insize - inptr) == size - 8);
+  ifd = saved_ifd;
+  test = saved_test;
+  in_offset = saved_offset;
+  clear_bufs ();
+  return ok;
+}
+
+/* ===========================================================================
+ * Hash the rest of the input file IN, at the current compression level,
+ * and leave IN where it was.  Return a descriptor for the cached compressed
+ * data if there is one and it checks out, and -1 otherwise.  In the latter
+ * case, the output will be stored by cache_store if it can be.
+ */
+int
+cache_lookup (int in)
+{
+  static char const hex[] = "0123456789abcdef";
+  struct sha256_ctx ctx;
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  char params[64];
+  struct stat st;
+  off_t start;
+  char *p;
+  int i, fd;
+
+  cache_pending = false;
+  if (fstat (in, &st) != 0 || !S_ISREG (st.st_mode)
+      || (start = lseek (in, 0, SEEK_CUR)) < 0)
+    return -1;
+  if (sizeof cache_name < strlen (cache_dir) + 2 * SHA256_DIGEST_SIZE + 2)
+    {
+      errno = ENAMETOOLONG;
+      cache_warning (cache_dir);
+      return -1;
+    }
+
+  sha256_init_ctx (&ctx);
+  sprintf (params, "gzip %s -%d%s", Version, level, rsync ? " --rsyncable" : "");
+#ifdef IBM_Z_DFLTCC
+  strcat (params, " dfltcc");
+#endif
+  sha256_process_bytes (params, strlen (params) + 1, &ctx);
+
+  /* inbuf is not in use yet.  */
+  updcrc (NULL, 0);
+  cache_len = 0;
+  for (;;)
+    {
+      int n = read_buffer (in, (char *) inbuf, INBUFSIZ);
+      if (n == 0)
+        break;
+      if (n < 0)
+        read_error ();
+      sha256_process_bytes (inbuf, n, &ctx);
+      updcrc (inbuf, n);
+      cache_len += n;
+    }
+  cache_crc = getcrc ();
+  if (lseek (in, start, SEEK_SET) < 0)
+    read_error ();
+
+  sha256_finish_ctx (&ctx, digest);
+  strcpy (cache_name, cache_dir);
+  p = cache_name + strlen (cache_name);
+  if (p != cache_name && p[-1] != '/')
+    *p++ = '/';
+  for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+    {
+      *p++ = hex[digest[i] >> 4];
+      *p++ = hex[digest[i] & 0xf];
+    }
+  *p = '\0';
+
+  fd = open (cache_name, O_RDONLY | O_BINARY);
+  if (fd < 0)
+    {
+      if (errno != ENOENT)
+        cache_warning (cache_name);
+      cache_pending = errno == ENOENT;
+    }
+  else if (fstat (fd, &st) != 0 || !cache_check (fd, st.st_size))
+    {
+      /* A damaged entry is replaced by the output.  */
+      if (!quiet)
+        fprintf (stderr, "%s: %s: invalid cache entry -- removed\n",
+                 program_name, cache_name);
+      close (fd);
+      fd = -1;
+      cache_pending = unlink (cache_name) == 0 || errno == ENOENT;
+    }
+  return fd;
+}
+
+/* Copy LEN bytes, or up to end of file if LEN is -1, from IN at offset
+ * *IN_OFF to OUT at its current position.  Return the number of bytes
+ * copied, or -1 on error with errno set.
+ */
+static off_t
+copy_range (int in, off_t *in_off, int out, off_t len)
+{
+  off_t copied = 0;
+  bool try_cfr = true;
+
+  while (len < 0 || copied < len)
+    {
+      size_t chunk = len < 0 || INT_MAX < len - copied ? INT_MAX : len - copied;
+      ssize_t n = -1;
+
+      if (try_cfr)
+        {
+          n = copy_file_range (in, in_off, out, NULL, chunk, 0);
+          if (n < 0)
+            {
+              if (errno != ENOSYS && errno != EXDEV && errno != EINVAL
+                  && errno != EOPNOTSUPP && errno != EBADF)
+                return -1;
+              try_cfr = false;
+            }
+        }
+      if (!try_cfr)
+        {
+          /* outbuf is free: the header has been flushed.  */
+          ssize_t w;
+          n = pread (in, outbuf, chunk < OUTBUFSIZ ? chunk : OUTBUFSIZ,
+                     *in_off);
+          for (w = 0; w < n; )
+            {
+              ssize_t r = write (out, outbuf + w, n - w);
+              if (r < 0)
+                return -1;
+              w += r;
+            }
+          if (0 < n)
+            *in_off += n;
+        }
+      if (n < 0)
+        return -1;
+      if (n == 0)
+        break;
+      copied += n;
+    }
+  return copied;
+}
+
+/* ===========================================================================
+ * Copy the cached compressed data in FD to OUT, after the header.
+ * Return OK, or ERROR if the cache could not be read, in which case
+ * the output is incomplete.
+ */
+int
+cache_copy (int fd, int out)
+{
+  off_t off = 0;
+  off_t n;
+
+  flush_outbuf ();
+  n = copy_range (fd, &off, out, -1);
+  if (n < 0)
+    {
+      fprintf (stderr, "%s: %s: %s\n", program_name, cache_name,
+               strerror (errno));
+      exit_code = ERROR;
+    }
+  close (fd);
+  if (n < 0)
+    return ERROR;
+  bytes_in = cache_len;
+  bytes_out += n;
+  return OK;
+}
+
+/* ===========================================================================
+ * Add the compressed data just written to OUT, after its first
+ * HEADER_LEN bytes, to the cache if cache_lookup asked for it.
+ * OUT must be readable.  Do nothing if the input changed meanwhile.
+ */
+void
+cache_store (int out, off_t header_len)
+{
+  char tmp[MAX_PATH_LEN + 16];
+  off_t off = header_len;
+  int fd;
+
+  if (!cache_pending)
+    return;
+  cache_pending = false;
+  if (bytes_in != cache_len || getcrc () != cache_crc)
+    return;
+
+  sprintf (tmp, "%s.%ld", cache_name, (long) getpid ());
+  fd = open (tmp, O_WRONLY | O_CREAT | O_EXCL | O_BINARY,
+             S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd < 0 && errno == ENOENT && mkdir (cache_dir, 0777) == 0)
+    fd = open (tmp, O_WRONLY | O_CREAT | O_EXCL | O_BINARY,
+               S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd < 0)
+    {
+      cache_warning (tmp);
+      return;
+    }
+  if (copy_range (out, &off, fd, bytes_out - header_len)
+      != bytes_out - header_len)
+    {
+      cache_warning (tmp);
+      close (fd);
+      unlink (tmp);
+      return;
+    }
+  /* Make the data durable before its name, so that a crash cannot
+     leave an empty or partial entry under a valid key.  */
+  if (fsync (fd) != 0 && errno != EINVAL)
+    {
+      cache_warning (tmp);
+      close (fd);
+      unlink (tmp);
+      return;
+    }
+  if (close (fd) != 0)
+    {
+      cache_warning (tmp);
+      unlink (tmp);
+      return;
+    }
+  if (rename (tmp, cache_name) != 0)
+    {
+      cache_warning (cache_name);
+      unlink (tmp);
+    }
+}
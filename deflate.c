@@ -125,7 +125,9 @@
 #ifndef TOO_FAR
 #  define TOO_FAR 4096
 #endif
-/* Matches of length 3 are discarded if their distance exceeds TOO_FAR */
+/* Matches of length 3 are discarded if their distance exceeds too_far,
+ * which is TOO_FAR except for some kinds of data (see tune_segment).
+ */
 
 #ifndef RSYNC_WIN
 #  define RSYNC_WIN 4096
@@ -213,6 +215,9 @@ static unsigned int max_lazy_match;
 unsigned good_match;
 /* Use a faster search when the previous match is longer than this */
 
+static unsigned too_far;
+/* Discard matches of length 3 at a greater distance than this */
+
 static ulg rsync_sum;  /* rolling sum of rsync window */
 static ulg rsync_chunk_end; /* next rsync sequence point */
 
@@ -256,6 +261,30 @@ static config configuration_table[10] = {
 /* 8 */ {32, 128, 258, 1024},
 /* 9 */ {32, 258, 258, 4096}}; /* maximum compression */
 
+/* Kinds of input data.  Each chunk read into the window is classified,
+ * and the parameters above are adapted to it while it is compressed:
+ * long hash chains find nothing in compressed or encrypted data, and
+ * far short matches cost more than they save in numeric text.  Other
+ * text and structured binary data such as executables keep the values
+ * above, since their chains pay off.
+ */
+enum { SEG_TEXT, SEG_NUMERIC, SEG_BINARY, SEG_RANDOM };
+
+static struct seg_tuning {
+   uch chain_shift; /* divide max_chain by 2**chain_shift */
+   uch nice_shift;  /* divide nice_length by 2**nice_shift */
+   uch lazy_shift;  /* divide max_lazy by 2**lazy_shift (lazy levels only) */
+   ush too_far;     /* too_far */
+} const seg_tuning[] = {
+/*               chain nice lazy too_far */
+/* SEG_TEXT */    {0,    0,   0,  TOO_FAR},
+/* SEG_NUMERIC */ {0,    0,   0,  256},     /* short matches are cheap */
+/* SEG_BINARY */  {0,    0,   0,  TOO_FAR},
+/* SEG_RANDOM */  {6,    3,   3,  TOO_FAR}};
+
+static int cur_level;    /* the level given to lm_init */
+static int seg_type;     /* kind of the data last read, or -1 */
+
 /* Note: the deflate() code requires max_lazy >= MIN_MATCH and max_chain >= 4
  * For deflate_fast() (levels <= 3) good is ignored and lazy has a different
  * meaning.
@@ -265,6 +294,7 @@ static config configuration_table[10] = {
  *  Prototypes for local functions.
  */
 static void fill_window (void);
+static void tune_segment (uch const *buf, unsigned size);
 static off_t deflate_fast (void);
 
 #ifdef ASMV
@@ -307,6 +337,7 @@ lm_init (int pack_level)
     register unsigned j;
 
     if (pack_level < 1 || pack_level > 9) gzip_error ("bad pack level");
+    cur_level = pack_level;
 
     /* Initialize the hash table. */
 #if defined MAXSEG_64K && HASH_BITS == 15
@@ -328,7 +359,8 @@ lm_init (int pack_level)
     nice_match       = configuration_table[pack_level].nice_length;
 #endif
     max_chain_length = configuration_table[pack_level].max_chain;
-    /* ??? reduce max_chain_length for binary files */
+    too_far          = TOO_FAR;
+    seg_type         = -1;
 
     strstart = 0;
     block_start = 0L;
@@ -344,6 +376,7 @@ lm_init (int pack_level)
        return;
     }
     eofile = 0;
+    tune_segment (window, lookahead);
     /* Make sure that we always have enough lookahead. This is important
      * if input comes from a device such as a tty.
      */
@@ -577,11 +610,66 @@ fill_window ()
             /* Don't let garbage pollute the dictionary.  */
             memzero (window + strstart + lookahead, MIN_MATCH - 1);
         } else {
+            tune_segment (window + strstart + lookahead, n);
             lookahead += n;
         }
     }
 }
 
+/* ===========================================================================
+ * Classify the SIZE bytes at BUF, just read into the window, and set
+ * the match parameters for that kind of data.
+ */
+static void
+tune_segment (uch const *buf, unsigned size)
+{
+    unsigned count[256];
+    unsigned step = size < 4096 ? 1 : size / 4096; /* sample at most 4K */
+    unsigned n = 0, i, c, distinct = 0, most = 0;
+    unsigned ctrl = 0, digits = 0;
+    int type;
+    config const *base = &configuration_table[cur_level];
+    struct seg_tuning const *t;
+
+    if (size < 256) return; /* too little to tell, keep the last setting */
+
+    memzero ((char *)count, sizeof count);
+    for (i = 0; i < size; i += step, n++) count[buf[i]]++;
+    for (c = 0; c < 256; c++) {
+        if (count[c] == 0) continue;
+        distinct++;
+        if (most < count[c]) most = count[c];
+        if (c < 32 ? !(c == '\t' || c == '\n' || c == '\r' || c == '\f')
+            : c == 127)
+            ctrl += count[c];
+        else if (('0' <= c && c <= '9') || c == '.' || c == '-' || c == '+')
+            digits += count[c];
+    }
+
+    if (ctrl <= n / 64)
+        type = digits >= n / 2 ? SEG_NUMERIC : SEG_TEXT;
+    else if (distinct >= 240 && most <= 3 * n / 256 + 8)
+        type = SEG_RANDOM;
+    else
+        type = SEG_BINARY;
+    if (type == seg_type) return;
+    seg_type = type;
+    t = &seg_tuning[type];
+
+    max_chain_length = base->max_chain >> t->chain_shift;
+    if (max_chain_length < 4) max_chain_length = 4;
+#ifndef FULL_SEARCH
+    nice_match = base->nice_length >> t->nice_shift;
+    if (nice_match < MIN_MATCH + 1) nice_match = MIN_MATCH + 1;
+#endif
+    if (cur_level > 3) {
+        max_lazy_match = base->max_lazy >> t->lazy_shift;
+        if (max_lazy_match < MIN_MATCH) max_lazy_match = MIN_MATCH;
+    }
+    too_far = t->too_far;
+    Trace((stderr, "\nsegment type %d", type));
+}
+
 /* With an initial offset of START, advance rsync's rolling checksum
    by NUM bytes.  */
 static void
@@ -757,7 +845,7 @@ gzip_deflate (int pack_level)
             if (match_length > lookahead) match_length = lookahead;
 
             /* Ignore a length 3 match if it is too distant: */
-            if (match_length == MIN_MATCH && strstart-match_start > TOO_FAR){
+            if (match_length == MIN_MATCH && strstart-match_start > too_far){
                 /* If prev_match is also MIN_MATCH, match_start is garbage
                  * but we will ignore the current match anyway.
                  */
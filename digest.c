@@ -0,0 +1,251 @@
+/* digest.c -- strong digests of the uncompressed data for gzip
+
+   Copyright (C) 2025 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* With --digest=sha256, the SHA-256 of the uncompressed data is computed
+ * on the data file_read reads when compressing.  If the output can be
+ * written again at the start of the member (a file, not a pipe or a file
+ * opened for appending), the header gets an extra field with a subfield
+ * 'S','2' of 32 bytes, first zero and filled in once the member is
+ * complete.  When decompressing, a member with a nonzero subfield of
+ * that kind is checked against the data flush_window writes, with or
+ * without --digest.
+ *
+ * With --digest=sha256:FILE, a line in the format of sha256sum is also
+ * appended to FILE for each file compressed or decompressed, from the
+ * data read or written.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "tailor.h"
+#include "gzip.h"
+#include "sha256.h"
+
+#define DIGEST_SI1   'S'    /* subfield ID of a SHA-256 digest */
+#define DIGEST_SI2   '2'
+#define DIGEST_FIELD (4 + SHA256_DIGEST_SIZE) /* subfield header and data */
+
+int digest_type;            /* --digest, or DIGEST_NONE */
+int digest_mode;            /* data hashed for the current file, or DIGEST_OFF */
+bool digest_member;         /* the current member has a digest to check */
+
+static char const *digest_name;  /* the FILE of --digest, or NULL */
+static FILE *digest_fp;
+static struct sha256_ctx file_ctx;   /* of the data of the current file */
+static struct sha256_ctx member_ctx; /* of the current member */
+static unsigned char file_digest[SHA256_DIGEST_SIZE];
+static unsigned char member_digest[SHA256_DIGEST_SIZE]; /* expected */
+static off_t field_offset;  /* of the subfield data in the output */
+
+/* ===========================================================================
+ * Parse ARG, the argument of --digest.  Return false if it is invalid.
+ */
+bool
+digest_option (char const *arg)
+{
+  char const *colon = strchr (arg, ':');
+  size_t len = colon ? (size_t) (colon - arg) : strlen (arg);
+
+  if (! (len == 6 && memcmp (arg, "sha256", 6) == 0) || (colon && !colon[1]))
+    return false;
+  digest_type = DIGEST_SHA256;
+  digest_name = colon ? colon + 1 : NULL;
+  return true;
+}
+
+/* ===========================================================================
+ * Open the FILE of --digest, if any.  Return OK or ERROR.
+ */
+int
+digest_open ()
+{
+  if (!digest_name)
+    return OK;
+  digest_fp = fopen (digest_name, "a");
+  if (digest_fp)
+    return OK;
+  fprintf (stderr, "%s: %s: %s\n", program_name, digest_name,
+           strerror (errno));
+  return ERROR;
+}
+
+/* ===========================================================================
+ * Start hashing the data of a file: the data read if MODE is
+ * DIGEST_INPUT, the data written if it is DIGEST_OUTPUT.  The latter
+ * is needed only for the FILE of --digest.
+ */
+void
+digest_start (int mode)
+{
+  if (!digest_type || (mode == DIGEST_OUTPUT && !digest_fp))
+    return;
+  sha256_init_ctx (&file_ctx);
+  digest_mode = mode;
+}
+
+/* ===========================================================================
+ * Hash the LEN bytes at BUF, read or written for the current file.
+ */
+void
+digest_update (void const *buf, unsigned len)
+{
+  sha256_process_bytes (buf, len, &file_ctx);
+}
+
+/* ===========================================================================
+ * Done with the data of the current file: compute its digest.
+ */
+void
+digest_finish ()
+{
+  if (digest_mode == DIGEST_OFF)
+    return;
+  sha256_finish_ctx (&file_ctx, file_digest);
+  digest_mode = DIGEST_OFF;
+}
+
+/* ===========================================================================
+ * Append the digest of the current file and NAME to the FILE of
+ * --digest, if any.
+ */
+void
+digest_record (char const *name)
+{
+  static char const hex[] = "0123456789abcdef";
+  int i;
+
+  if (!digest_fp)
+    return;
+  digest_finish ();
+
+  for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+    {
+      putc (hex[file_digest[i] >> 4], digest_fp);
+      putc (hex[file_digest[i] & 0xf], digest_fp);
+    }
+  fprintf (digest_fp, "  %s\n", name);
+  if (fflush (digest_fp) != 0)
+    {
+      fprintf (stderr, "%s: %s: %s\n", program_name, digest_name,
+               strerror (errno));
+      exit_code = ERROR;
+    }
+}
+
+/* ===========================================================================
+ * Return true if the header of the member about to be written to OUT
+ * can have a digest, that is if the digest can be filled in later.
+ */
+bool
+digest_fillable (int out)
+{
+  int fl;
+
+  field_offset = -1;
+  return (digest_type
+          && 0 <= (fl = fcntl (out, F_GETFL)) && !(fl & O_APPEND)
+          && 0 <= (field_offset = lseek (out, 0, SEEK_CUR)));
+}
+
+/* ===========================================================================
+ * Put the extra field of the digest, still zero, in the header.
+ */
+void
+digest_field ()
+{
+  int i;
+
+  /* The data follows the length of the field and the subfield header.  */
+  field_offset += outcnt + 2 + 4;
+  put_short (DIGEST_FIELD);
+  put_byte (DIGEST_SI1);
+  put_byte (DIGEST_SI2);
+  put_short (SHA256_DIGEST_SIZE);
+  for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+    put_byte (0);
+}
+
+/* ===========================================================================
+ * The member written to OUT is complete: fill in its digest.
+ */
+void
+digest_fill (int out)
+{
+  digest_finish ();
+  if (pwrite (out, file_digest, SHA256_DIGEST_SIZE, field_offset)
+      != SHA256_DIGEST_SIZE)
+    write_error ();
+}
+
+/* ===========================================================================
+ * Look for a digest in the LEN bytes of the extra field EXTRA of the
+ * member about to be decompressed, and set digest_member if there is one.
+ */
+void
+digest_expect (uch const *extra, unsigned len)
+{
+  digest_member = false;
+  while (4 <= len)
+    {
+      unsigned n = extra[2] | (extra[3] << 8);
+      if (len - 4 < n)
+        break;
+      if (extra[0] == DIGEST_SI1 && extra[1] == DIGEST_SI2
+          && n == SHA256_DIGEST_SIZE)
+        {
+          unsigned i;
+          for (i = 0; i < n; i++)
+            if (extra[4 + i])
+              break;
+          if (i == n)
+            return;             /* never filled in */
+          memcpy (member_digest, extra + 4, n);
+          sha256_init_ctx (&member_ctx);
+          digest_member = true;
+          return;
+        }
+      extra += 4 + n;
+      len -= 4 + n;
+    }
+}
+
+/* ===========================================================================
+ * Hash the LEN bytes at BUF decompressed from the current member.
+ */
+void
+digest_member_update (void const *buf, unsigned len)
+{
+  sha256_process_bytes (buf, len, &member_ctx);
+}
+
+/* ===========================================================================
+ * The current member is decompressed: return OK if its digest matches.
+ */
+int
+digest_check ()
+{
+  unsigned char md[SHA256_DIGEST_SIZE];
+
+  digest_member = false;
+  sha256_finish_ctx (&member_ctx, md);
+  return memcmp (md, member_digest, sizeof md) == 0 ? OK : ERROR;
+}
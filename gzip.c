@@ -73,9 +73,11 @@ static char const *const license_msg[] = {
 #include "fcntl--.h"
 #include "filename.h"
 #include "ignore-value.h"
+#include "nproc.h"
 #include "stat-time.h"
 #include "version.h"
 #include "xalloc.h"
+#include "xstrtol.h"
 #include "yesno.h"
 
                 /* configuration */
@@ -84,6 +86,7 @@ static char const *const license_msg[] = {
 #include <inttypes.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/wait.h>
 
 #ifndef NO_DIR
 # define NO_DIR 0
@@ -101,6 +104,9 @@ static char const *const license_msg[] = {
 #  define MAX_PATH_LEN   1024 /* max pathname length */
 #endif
 
+/* Room for the ".tmpN" suffix of a --recompress output file.  */
+#define TMP_SUFFIX_LEN (sizeof ".tmp" + INT_STRLEN_BOUND (int))
+
 #ifndef SEEK_END
 #  define SEEK_END 2
 #endif
@@ -160,6 +166,11 @@ static bool synchronous;
 static int ascii = 0;        /* convert end-of-lines to local OS conventions */
        int to_stdout = 0;    /* output to stdout (-c) */
 static int decompress = 0;   /* decompress (-d) */
+static bool recompress;      /* decompress and compress again (--recompress) */
+static bool join;            /* join the input members into one (--join) */
+static bool batch;           /* decompress members in parallel (--batch) */
+static bool pack;            /* compress FILEs to an indexed bundle (--pack) */
+static char *member_name;    /* decompress only this member (--member) */
 static int force = 0;        /* don't ask questions, compress links (-f) */
 static int keep = 0;         /* keep (don't delete) input files */
 static int no_name = -1;     /* don't save or restore the original file name */
@@ -179,7 +190,8 @@ static int foreground = 0;   /* set if program run in foreground */
        int level = 6;        /* compression level */
        int exit_code = OK;   /* program exit code */
        int save_orig_name;   /* set if original name must be saved */
-static int last_member;      /* set for .zip and .Z files */
+       char *orig_name;      /* name to save instead of ifname, or NULL */
+       int last_member;      /* set for .zip and .Z files */
 static int part_nb;          /* number of parts in .gz file */
        off_t ifile_size;      /* input file size, -1 for devices (debug only) */
 static char *env;            /* contents of GZIP env variable */
@@ -196,6 +208,7 @@ struct timespec time_stamp;
 
 /* The set of signals that are caught.  */
 static sigset_t caught_signals;
+static bool signal_handlers_installed;
 
 /* If nonnegative, close this file descriptor and unlink remove_ofname
    on error.  */
@@ -204,12 +217,57 @@ static char volatile remove_ofname[MAX_PATH_LEN];
 
 static bool stdin_was_read;
 
+/* Extra outputs of --tee-levels and --raw-copy.  Each is written by a
+   child process from a pipe, to which file_read copies the input as
+   it is read for the main output.  A level of 0 means --raw-copy.
+   Until TEE_ACTIVE is reset, the first TEE_ACTIVE outputs are removed
+   on error.  */
+enum { MAX_TEES = 10 };
+static int tee_levels[MAX_TEES];
+static int tee_count;
+static char *raw_copy;
+static int tee_fd[MAX_TEES];
+static pid_t volatile tee_pid[MAX_TEES];
+static char volatile tee_name[MAX_TEES][MAX_PATH_LEN];
+static int volatile tee_active;
+
+/* With --verify, the compressed output is also written by flush_outbuf
+   to VERIFY_FD, a pipe to a child process VERIFY_PID that decompresses
+   it and checks it against the CRC and size of the input computed by
+   file_read, like gzip -t.  The child drains VERIFY_IN before exiting,
+   so that a failure does not kill the parent with SIGPIPE.  */
+static bool verify;
+static int verify_fd = -1;
+static pid_t volatile verify_pid;
+static int verify_in = -1;
+
+/* With --pipeline, the blocks are coded by a child process CODER_PID,
+   concurrently with the search for matches (see trees.c); or when
+   decompressing, it writes the data that is decoded (see inflate.c).  */
+static bool pipeline;
+static pid_t volatile coder_pid;
+
+/* With --synchronous, the outputs of up to SYNC_BATCH files are made
+   durable together, by one syncfs per file system, before the inputs of
+   those files are removed.  */
+#ifndef SYNC_BATCH
+# define SYNC_BATCH 256
+#endif
+#define SYNC_MAX_FS 8
+static char *sync_iname[SYNC_BATCH]; /* inputs to remove once synced */
+static int sync_count;               /* number of files in the batch */
+static pid_t sync_owner;             /* the process that made the batch */
+static int sync_fd[SYNC_MAX_FS];     /* an output on each file system */
+static dev_t sync_dev[SYNC_MAX_FS];  /* and its device */
+static int sync_fs_count;            /* number of file systems */
+
 off_t bytes_in;             /* number of input bytes */
 off_t bytes_out;            /* number of output bytes */
 static off_t total_in;      /* input bytes for all files */
 static off_t total_out;	    /* output bytes for all files */
 char ifname[MAX_PATH_LEN]; /* input file name */
 char ofname[MAX_PATH_LEN]; /* output file name */
+static char recompress_name[MAX_PATH_LEN]; /* name found by --recompress */
 static char dfname[MAX_PATH_LEN]; /* name of dir containing output file */
 static struct stat istat;         /* status for input file */
 int  ifd;                  /* input file descriptor */
@@ -247,8 +305,22 @@ static int handled_sig[] =
 enum
 {
   PRESUME_INPUT_TTY_OPTION = CHAR_MAX + 1,
+  ACCESS_POINTS_OPTION,
+  BACKGROUND_OPTION,
+  BATCH_OPTION,
+  CACHE_DIR_OPTION,
+  DIGEST_OPTION,
+  JOIN_OPTION,
+  MEMBER_OPTION,
+  PACK_OPTION,
+  PIPELINE_OPTION,
+  RAW_COPY_OPTION,
+  RECOMPRESS_OPTION,
+  RESUMABLE_OPTION,
   RSYNCABLE_OPTION,
   SYNCHRONOUS_OPTION,
+  TEE_LEVELS_OPTION,
+  VERIFY_OPTION
 };
 
 static char const shortopts[] = "ab:cdfhH?klLmMnNqrS:tvVZ123456789";
@@ -256,28 +328,42 @@ static char const shortopts[] = "ab:cdfhH?klLmMnNqrS:tvVZ123456789";
 static const struct option longopts[] =
 {
  /* { name  has_arg  *flag  val } */
+    {"access-points", 2, 0, ACCESS_POINTS_OPTION}, /* for random access */
     {"ascii",      0, 0, 'a'}, /* ascii text mode */
+    {"background", 2, 0, BACKGROUND_OPTION}, /* yield to other work */
+    {"batch",      0, 0, BATCH_OPTION}, /* decompress members in parallel */
+    {"cache-dir",  1, 0, CACHE_DIR_OPTION}, /* reuse compressed data */
     {"to-stdout",  0, 0, 'c'}, /* write output on standard output */
     {"stdout",     0, 0, 'c'}, /* write output on standard output */
     {"decompress", 0, 0, 'd'}, /* decompress */
+    {"digest",     1, 0, DIGEST_OPTION}, /* also compute a strong digest */
     {"uncompress", 0, 0, 'd'}, /* decompress */
  /* {"encrypt",    0, 0, 'e'},    encrypt */
     {"force",      0, 0, 'f'}, /* force overwrite of output file */
     {"help",       0, 0, 'h'}, /* give help */
+    {"join",       0, 0, JOIN_OPTION}, /* join members into one */
  /* {"pkzip",      0, 0, 'k'},    force output in pkzip format */
     {"keep",       0, 0, 'k'}, /* keep (don't delete) input files */
     {"list",       0, 0, 'l'}, /* list .gz file contents */
     {"license",    0, 0, 'L'}, /* display software license */
     {"no-name",    0, 0, 'n'}, /* don't save or restore original name & time */
+    {"member",     1, 0, MEMBER_OPTION}, /* decompress one --pack member */
     {"name",       0, 0, 'N'}, /* save or restore original name & time */
+    {"pack",       0, 0, PACK_OPTION}, /* bundle FILEs with an index */
+    {"pipeline",   0, 0, PIPELINE_OPTION}, /* code blocks in a child */
     {"-presume-input-tty", no_argument, NULL, PRESUME_INPUT_TTY_OPTION},
     {"quiet",      0, 0, 'q'}, /* quiet mode */
+    {"raw-copy",   1, 0, RAW_COPY_OPTION}, /* also copy the input there */
+    {"recompress", 0, 0, RECOMPRESS_OPTION}, /* change compression level */
+    {"resumable",  2, 0, RESUMABLE_OPTION}, /* resume after interruption */
     {"silent",     0, 0, 'q'}, /* quiet mode */
     {"synchronous",0, 0, SYNCHRONOUS_OPTION}, /* output data synchronously */
     {"recursive",  0, 0, 'r'}, /* recurse through directories */
     {"suffix",     1, 0, 'S'}, /* use given suffix instead of .gz */
+    {"tee-levels", 1, 0, TEE_LEVELS_OPTION}, /* also compress at levels */
     {"test",       0, 0, 't'}, /* test compressed file integrity */
     {"verbose",    0, 0, 'v'}, /* verbose mode */
+    {"verify",     0, 0, VERIFY_OPTION}, /* test the output as it is written */
     {"version",    0, 0, 'V'}, /* display version number */
     {"fast",       0, 0, '1'}, /* compress faster */
     {"best",       0, 0, '9'}, /* compress better */
@@ -296,6 +382,11 @@ static void version (void);
 static int input_eof (void);
 static void treat_stdin (void);
 static void treat_file (char *iname);
+static void treat_zip_entries (int count);
+static void treat_pack (char **names, int count);
+static bool batch_scan (int in);
+static int treat_batch (int in, int out);
+static void remove_input_file (void);
 static int create_outfile (void);
 static char *get_suffix (char *name);
 static int  open_input_file (char *iname, struct stat *sbuf);
@@ -303,6 +394,13 @@ static void discard_input_bytes (size_t nbytes, unsigned int flags);
 static int  make_ofname (void);
 static void shorten_name (char *name);
 static int  get_method (int in);
+static void start_recompress (void);
+static bool sync_add (int out);
+static void sync_flush (void);
+static int  start_tees (bool from_file);
+static int  finish_tees (void);
+static int  recompress_members (int in, int out);
+static int  replace_input_file (void);
 static void do_list (int method);
 static int  check_ofname (void);
 static void copy_stat (struct stat *ifstat);
@@ -340,30 +438,49 @@ help ()
 #if O_BINARY
  "  -a, --ascii       ascii text; convert end-of-line using local conventions",
 #endif
+ "      --access-points[=SIZE]  reset the history every SIZE input bytes",
+ "                    (default 1M), listing the points in FILE.gz.idx",
+ "      --background[=RATE]  run at idle priority, at most RATE bytes/s",
+ "                    of I/O, and back off when the system is busy",
+ "      --batch       decompress the members of BGZF-style files in parallel",
+ "      --cache-dir=DIR  reuse compressed data kept in DIR",
  "  -c, --stdout      write on standard output, keep original files unchanged",
  "  -d, --decompress  decompress",
+ "      --digest=sha256[:FILE]  store the SHA-256 of the data when compressing,",
+ "                    and also list it in FILE",
 /*  -e, --encrypt     encrypt */
  "  -f, --force       force overwrite of output file and compress links",
  "  -h, --help        give this help",
+ "      --join        join the members of FILEs into one member on stdout",
 /*  -k, --pkzip       force output in pkzip format */
  "  -k, --keep        keep (don't delete) input files",
  "  -l, --list        list compressed file contents",
  "  -L, --license     display software license",
+ "      --member=NAME  decompress only the member NAME of a --pack file",
 #ifdef UNDOCUMENTED
  "  -m                do not save or restore the original modification time",
  "  -M, --time        save or restore the original modification time",
 #endif
  "  -n, --no-name     do not save or restore the original name and timestamp",
  "  -N, --name        save or restore the original name and timestamp",
+ "      --pack        compress FILEs concurrently to one file on stdout,",
+ "                    with an index of its members",
+ "      --pipeline    compress or decompress in two processes",
  "  -q, --quiet       suppress all warnings",
 #if ! NO_DIR
  "  -r, --recursive   operate recursively on directories",
 #endif
+ "      --raw-copy=FILE  also copy the uncompressed input to FILE",
+ "      --recompress  decompress and compress again with the given options",
+ "      --resumable[=SIZE]  checkpoint every SIZE input bytes (default 64M)",
+ "                    to resume an interrupted compression",
  "      --rsyncable   make rsync-friendly archive",
  "  -S, --suffix=SUF  use suffix SUF on compressed files",
  "      --synchronous synchronous output (safer if system crashes, but slower)",
+ "      --tee-levels=L1,L2...  compress at level L1 and also to FILE.L2.gz, ...",
  "  -t, --test        test compressed file integrity",
  "  -v, --verbose     verbose mode",
+ "      --verify      test the compressed output as it is written",
  "  -V, --version     display version number",
  "  -1, --fast        compress faster",
  "  -9, --best        compress better",
@@ -523,6 +640,101 @@ int main (int argc, char **argv)
             presume_input_tty = true; break;
         case 'q':
             quiet = 1; verbose = 0; break;
+        case ACCESS_POINTS_OPTION:
+#ifdef IBM_Z_DFLTCC
+            fprintf (stderr, "%s: --access-points not supported on this system\n",
+                     program_name);
+            try_help ();
+#endif
+            index_interval = ACCESS_INTERVAL;
+            if (optarg)
+              {
+                uintmax_t n;
+                if (xstrtoumax (optarg, NULL, 10, &n, "kKmMgGT") != LONGINT_OK
+                    || n == 0 || TYPE_MAXIMUM (off_t) < n)
+                  {
+                    fprintf (stderr, "%s: invalid --access-points size '%s'\n",
+                             program_name, optarg);
+                    try_help ();
+                  }
+                index_interval = n;
+              }
+            break;
+        case BACKGROUND_OPTION:
+            background = true;
+            if (optarg)
+              {
+                uintmax_t n;
+                if (xstrtoumax (optarg, NULL, 10, &n, "kKmMgGT") != LONGINT_OK
+                    || n == 0 || TYPE_MAXIMUM (intmax_t) / 1000000000 < n)
+                  {
+                    fprintf (stderr, "%s: invalid --background rate '%s'\n",
+                             program_name, optarg);
+                    try_help ();
+                  }
+                background_rate = n;
+              }
+            break;
+        case BATCH_OPTION:
+            batch = true; break;
+        case CACHE_DIR_OPTION:
+            cache_dir = optarg; break;
+        case MEMBER_OPTION:
+            member_name = optarg; break;
+        case PACK_OPTION:
+            pack = true; break;
+        case PIPELINE_OPTION:
+#ifdef IBM_Z_DFLTCC
+            fprintf (stderr, "%s: --pipeline not supported on this system\n",
+                     program_name);
+            try_help ();
+#endif
+            pipeline = true; break;
+        case JOIN_OPTION:
+#ifdef IBM_Z_DFLTCC
+            fprintf (stderr, "%s: --join not supported on this system\n",
+                     program_name);
+            try_help ();
+#endif
+            join = true; break;
+        case DIGEST_OPTION:
+            if (! digest_option (optarg))
+              {
+                fprintf (stderr, "%s: invalid --digest '%s'\n",
+                         program_name, optarg);
+                try_help ();
+              }
+            break;
+        case RAW_COPY_OPTION:
+            if (tee_count == MAX_TEES)
+              try_help ();
+            raw_copy = optarg;
+            tee_levels[tee_count++] = 0;
+            break;
+        case RECOMPRESS_OPTION:
+            recompress = true; break;
+        case VERIFY_OPTION:
+            verify = true; break;
+        case RESUMABLE_OPTION:
+#ifdef IBM_Z_DFLTCC
+            fprintf (stderr, "%s: --resumable not supported on this system\n",
+                     program_name);
+            try_help ();
+#endif
+            resume_interval = RESUME_INTERVAL;
+            if (optarg)
+              {
+                uintmax_t n;
+                if (xstrtoumax (optarg, NULL, 10, &n, "kKmMgGT") != LONGINT_OK
+                    || n == 0 || TYPE_MAXIMUM (off_t) < n)
+                  {
+                    fprintf (stderr, "%s: invalid --resumable size '%s'\n",
+                             program_name, optarg);
+                    try_help ();
+                  }
+                resume_interval = n;
+              }
+            break;
         case 'r':
 #if NO_DIR
             fprintf (stderr, "%s: -r not supported on this system\n",
@@ -551,6 +763,43 @@ int main (int argc, char **argv)
         case SYNCHRONOUS_OPTION:
             synchronous = true;
             break;
+        case TEE_LEVELS_OPTION:
+            {
+              char const *p = optarg;
+              bool first = true;
+              do
+                {
+                  int i;
+                  if (! ('1' <= *p && *p <= '9')
+                      || (p[1] && (p[1] != ',' || !p[2])))
+                    {
+                      fprintf (stderr, "%s: invalid --tee-levels list '%s'\n",
+                               program_name, optarg);
+                      try_help ();
+                    }
+                  if (first)
+                    level = *p - '0';
+                  else
+                    {
+                      for (i = 0; i < tee_count; i++)
+                        if (tee_levels[i] == *p - '0')
+                          break;
+                      if (i < tee_count || level == *p - '0'
+                          || tee_count == MAX_TEES)
+                        {
+                          fprintf (stderr,
+                                   "%s: level %c given twice to --tee-levels\n",
+                                   program_name, *p);
+                          try_help ();
+                        }
+                      tee_levels[tee_count++] = *p - '0';
+                    }
+                  first = false;
+                  p += p[1] ? 2 : 1;
+                }
+              while (*p);
+            }
+            break;
         case 't':
             test = decompress = to_stdout = 1;
             break;
@@ -592,6 +841,111 @@ int main (int argc, char **argv)
         fprintf(stderr, "%s: invalid suffix '%s'\n", program_name, z_suffix);
         do_exit(ERROR);
     }
+    if (recompress && (decompress || (keep && !to_stdout))) {
+        fprintf (stderr, "%s: --recompress cannot be combined with %s\n",
+                 program_name, decompress ? "-d, -l or -t" : "-k");
+        try_help ();
+    }
+    if (tee_count && (decompress || recompress)) {
+        fprintf (stderr,
+                 "%s: --tee-levels and --raw-copy cannot be combined with %s\n",
+                 program_name, decompress ? "-d, -l or -t" : "--recompress");
+        try_help ();
+    }
+    if (cache_dir && (decompress || recompress || tee_count || ascii)) {
+        fprintf (stderr, "%s: --cache-dir cannot be combined with %s\n",
+                 program_name,
+                 (decompress ? "-d, -l or -t"
+                  : recompress ? "--recompress"
+                  : tee_count ? "--tee-levels or --raw-copy" : "-a"));
+        try_help ();
+    }
+    if (pack
+        && (decompress || recompress || tee_count || cache_dir
+            || resume_interval || join || recursive)) {
+        fprintf (stderr, "%s: --pack cannot be combined with %s\n",
+                 program_name,
+                 (decompress ? "-d, -l or -t"
+                  : recompress ? "--recompress"
+                  : tee_count ? "--tee-levels or --raw-copy"
+                  : cache_dir ? "--cache-dir"
+                  : resume_interval ? "--resumable"
+                  : join ? "--join" : "-r"));
+        try_help ();
+    }
+    if (pack && !file_count) {
+        fprintf (stderr, "%s: --pack needs file operands\n", program_name);
+        try_help ();
+    }
+    if (pack)
+        to_stdout = 1;
+    if (member_name && (!decompress || list)) {
+        fprintf (stderr, "%s: --member needs -d or -t\n", program_name);
+        try_help ();
+    }
+    if (member_name)
+        to_stdout = 1;
+    if (batch && (!decompress || list)) {
+        fprintf (stderr, "%s: --batch needs -d or -t\n", program_name);
+        try_help ();
+    }
+    if (resume_interval
+        && (decompress || recompress || to_stdout || tee_count || cache_dir)) {
+        fprintf (stderr, "%s: --resumable cannot be combined with %s\n",
+                 program_name,
+                 (decompress ? "-d, -l or -t"
+                  : recompress ? "--recompress"
+                  : to_stdout ? "-c"
+                  : tee_count ? "--tee-levels or --raw-copy" : "--cache-dir"));
+        try_help ();
+    }
+    if (index_interval
+        && (decompress || join || recompress || cache_dir || resume_interval)) {
+        fprintf (stderr, "%s: --access-points cannot be combined with %s\n",
+                 program_name,
+                 (decompress ? "-d, -l or -t"
+                  : join ? "--join"
+                  : recompress ? "--recompress"
+                  : cache_dir ? "--cache-dir" : "--resumable"));
+        try_help ();
+    }
+    if (join
+        && (decompress || recompress || tee_count || cache_dir
+            || resume_interval || verify || digest_type)) {
+        fprintf (stderr, "%s: --join cannot be combined with %s\n",
+                 program_name,
+                 (decompress ? "-d, -l or -t"
+                  : recompress ? "--recompress"
+                  : tee_count ? "--tee-levels or --raw-copy"
+                  : cache_dir ? "--cache-dir"
+                  : resume_interval ? "--resumable"
+                  : verify ? "--verify" : "--digest"));
+        try_help ();
+    }
+    if (join)
+        decompress = to_stdout = 1;
+    if (digest_type && (cache_dir || resume_interval)) {
+        fprintf (stderr, "%s: --digest cannot be combined with %s\n",
+                 program_name, cache_dir ? "--cache-dir" : "--resumable");
+        try_help ();
+    }
+    if (verify && (decompress || cache_dir || resume_interval)) {
+        fprintf (stderr, "%s: --verify cannot be combined with %s\n",
+                 program_name,
+                 (decompress ? "-d, -l or -t"
+                  : cache_dir ? "--cache-dir" : "--resumable"));
+        try_help ();
+    }
+    if (raw_copy && (1 < file_count || recursive)) {
+        fprintf (stderr, "%s: --raw-copy needs a single input file\n",
+                 program_name);
+        try_help ();
+    }
+
+    if (digest_open () != OK)
+        do_exit (ERROR);
+    if (background)
+        background_start ();
 
     /* Allocate all global buffers (for DYN_ALLOC option) */
     ALLOC(uch, inbuf,  INBUFSIZ +INBUF_EXTRA);
@@ -610,8 +964,12 @@ int main (int argc, char **argv)
         if (to_stdout && !test && (!decompress || !ascii)) {
             SET_BINARY_MODE (STDOUT_FILENO);
         }
-        while (optind < argc) {
-            treat_file(argv[optind++]);
+        if (pack)
+            treat_pack (argv + optind, file_count);
+        else {
+            while (optind < argc) {
+                treat_file(argv[optind++]);
+            }
         }
     } else {  /* Standard input */
         treat_stdin();
@@ -629,6 +987,8 @@ int main (int argc, char **argv)
         if (fflush (stdout) != 0)
           write_error ();
       }
+    if (join)
+      join_finish (STDOUT_FILENO);
     if (to_stdout
         && ((synchronous
              && fdatasync (STDOUT_FILENO) != 0 && errno != EINVAL)
@@ -733,24 +1093,60 @@ treat_stdin ()
     ifd = STDIN_FILENO;
     stdin_was_read = true;
 
-    if (decompress) {
+    if (decompress || recompress) {
+        if (recompress)
+            start_recompress ();
+        if (member_name && pack_seek (ifd, member_name) != OK)
+            do_exit (exit_code);
         method = get_method(ifd);
         if (method < 0) {
             do_exit(exit_code); /* error message already emitted */
         }
+        if (recompress)
+            save_orig_name = recompress_name[0] != '\0';
     }
 
+    if (tee_count && start_tees (false) != OK) {
+        remove_output_file (false);
+        finish_tees ();
+        return;
+    }
+    if (decompress && !list)
+        digest_start (DIGEST_OUTPUT);
+
     /* Actually do the compression/decompression. Loop over zipped members.
      */
     for (;;) {
-        if (work (STDIN_FILENO, STDOUT_FILENO) != OK)
-          return;
+        if ((recompress
+             ? recompress_members (STDIN_FILENO, STDOUT_FILENO)
+             : join
+             ? join_member (STDIN_FILENO, STDOUT_FILENO)
+             : work (STDIN_FILENO, STDOUT_FILENO))
+            != OK)
+          {
+            coder_finish ();
+            return;
+          }
 
-        if (input_eof ())
+        if (member_name || input_eof ())
           break;
 
         method = get_method(ifd);
-        if (method < 0) return; /* error message already emitted */
+        if (method < 0) /* error message already emitted */
+          {
+            coder_finish ();
+            return;
+          }
+    }
+    if (coder_finish () != OK)
+        return;
+
+    if (tee_count) {
+        if (finish_tees () != OK) {
+            remove_output_file (false);
+            return;
+        }
+        tee_active = 0;
     }
 
     if (list)
@@ -758,6 +1154,7 @@ treat_stdin ()
         do_list (method);
         return;
       }
+    digest_record ("-");
 
     if (verbose) {
         if (test) {
@@ -814,217 +1211,1577 @@ atdir_set (char const *dir, ptrdiff_t dirlen)
       dfd = open (dfname, O_SEARCH | O_DIRECTORY);
     }
 
-  return dfd;
+  return dfd;
+}
+
+/* ========================================================================
+ * Compress or decompress the given file
+ */
+static void
+treat_file (char *iname)
+{
+    bool parallel;
+
+    /* Accept "-" as synonym for stdin */
+    if (strequ(iname, "-")) {
+        int cflag = to_stdout;
+        treat_stdin();
+        to_stdout = cflag;
+        return;
+    }
+
+    /* Check if the input file is present, set ifname and istat: */
+    ifd = open_input_file (iname, &istat);
+    if (ifd < 0)
+      return;
+
+    /* If the input name is that of a directory, recurse or ignore: */
+    if (S_ISDIR(istat.st_mode)) {
+#if ! NO_DIR
+        if (recursive) {
+            treat_dir (ifd, iname);
+            /* Warning: ifname is now garbage */
+            return;
+        }
+#endif
+        close (ifd);
+        WARN ((stderr, "%s: %s is a directory -- ignored\n",
+               program_name, ifname));
+        return;
+    }
+
+    if (! to_stdout)
+      {
+        if (! S_ISREG (istat.st_mode))
+          {
+            WARN ((stderr,
+                   "%s: %s is not a directory or a regular file - ignored\n",
+                   program_name, ifname));
+            close (ifd);
+            return;
+          }
+        if (istat.st_mode & S_ISUID)
+          {
+            WARN ((stderr, "%s: %s is set-user-ID on execution - ignored\n",
+                   program_name, ifname));
+            close (ifd);
+            return;
+          }
+        if (istat.st_mode & S_ISGID)
+          {
+            WARN ((stderr, "%s: %s is set-group-ID on execution - ignored\n",
+                   program_name, ifname));
+            close (ifd);
+            return;
+          }
+
+        if (! force)
+          {
+            if (istat.st_mode & S_ISVTX)
+              {
+                WARN ((stderr,
+                       "%s: %s has the sticky bit set - file ignored\n",
+                       program_name, ifname));
+                close (ifd);
+                return;
+              }
+            if (2 <= istat.st_nlink)
+              {
+                WARN ((stderr, "%s: %s has %lu other link%s -- file ignored\n",
+                       program_name, ifname,
+                       (unsigned long int) istat.st_nlink - 1,
+                       istat.st_nlink == 2 ? "" : "s"));
+                close (ifd);
+                return;
+              }
+          }
+      }
+
+    get_input_size_and_time ();
+
+    /* Generate output file name. For -r and (-t or -l), skip files
+     * without a valid gzip suffix (check done in make_ofname).
+     */
+    if (to_stdout && !test) {
+        strcpy(ofname, "stdout");
+
+    } else if (make_ofname() != OK) {
+        close (ifd);
+        return;
+    }
+
+    clear_bufs(); /* clear input and output buffers */
+    part_nb = 0;
+
+    if (decompress || recompress) {
+        if (recompress)
+            start_recompress ();
+        if (member_name && pack_seek (ifd, member_name) != OK) {
+            close (ifd);
+            return;
+        }
+        method = get_method(ifd); /* updates ofname if original given */
+        if (method < 0) {
+            close(ifd);
+            return;               /* error message already emitted */
+        }
+        if (decompress && !list && !join && S_ISREG (istat.st_mode)) {
+            int count = zip_entries (ifd);
+            if (count) {
+                treat_zip_entries (count);
+                return;
+            }
+        }
+    }
+
+    /* If compressing to a file, check if ofname is not ambiguous
+     * because the operating system truncates names. Otherwise, generate
+     * a new ofname and save the original name in the compressed file.
+     */
+    if (to_stdout) {
+        ofd = STDOUT_FILENO;
+        /* Keep remove_ofname_fd negative.  */
+    } else {
+        if (resume_interval)
+            resume_load (get_stat_mtime (&istat));
+        if (create_outfile() != OK) {
+            close (ifd);
+            if (resume_interval)
+                resume_finish (false);
+            return;
+        }
+
+        if (!decompress && save_orig_name && !verbose && !quiet) {
+            fprintf(stderr, "%s: %s compressed to %s\n",
+                    program_name, ifname, ofname);
+        }
+    }
+    /* Keep the name even if not truncated except with --no-name.
+     * When recompressing, keep exactly the name the input had.
+     */
+    if (recompress)
+        save_orig_name = recompress_name[0] != '\0';
+    else if (!save_orig_name)
+        save_orig_name = !no_name;
+
+    if (tee_count && start_tees (true) != OK) {
+        close (ifd);
+        remove_output_file (false);
+        finish_tees ();
+        return;
+    }
+
+    if (verbose && !list) {
+        fprintf(stderr, "%s:\t", ifname);
+    }
+    if (decompress && !list)
+        digest_start (DIGEST_OUTPUT);
+
+    /* With --batch, decompress all the members at once if their sizes
+     * are known.
+     */
+    parallel = (batch && !member_name && !tee_count && 0 <= ifile_size
+                && batch_scan (ifd));
+
+    /* Actually do the compression/decompression. Loop over zipped members.
+     */
+    for (;;) {
+        if ((recompress ? recompress_members (ifd, ofd)
+             : join ? join_member (ifd, ofd)
+             : parallel ? treat_batch (ifd, ofd)
+             : (*work)(ifd, ofd))
+            != OK) {
+            method = -1; /* force cleanup */
+            break;
+        }
+
+        if (parallel || member_name || input_eof ())
+          break;
+
+        method = get_method(ifd);
+        if (method < 0) break;    /* error message already emitted */
+    }
+    if (coder_finish () != OK)
+        method = -1;
+
+    if (tee_count && finish_tees () != OK)
+        method = -1;
+
+    if (cache_dir && 0 <= method && !to_stdout)
+        cache_store (ofd, header_bytes - 2*4);
+
+    if (close (ifd) != 0)
+      read_error ();
+
+    if (list)
+      {
+        do_list (method);
+        return;
+      }
+
+    if (!to_stdout)
+      {
+        bool batched;
+
+        copy_stat (&istat);
+
+        /* The output must be durable before the input is removed.  */
+        batched = (synchronous && !recompress && !tee_count
+                   && !resume_interval && method != -1 && sync_add (ofd));
+        if ((((synchronous && !batched) || resume_interval)
+             && ((0 <= dfd && fdatasync (dfd) != 0 && errno != EINVAL)
+                 || (fsync (ofd) != 0 && errno != EINVAL)))
+            || close (ofd) != 0)
+          write_error ();
+        if (resume_interval)
+          resume_finish (method != -1);
+
+        if (recompress)
+          {
+            if (method != -1 && replace_input_file () != OK)
+              method = -1;
+          }
+        else if (batched)
+          {
+            if (!keep)
+              sync_iname[sync_count] = xstrdup (ifname);
+            sync_owner = getpid ();
+            remove_ofname_fd = -1;
+            if (++sync_count == SYNC_BATCH)
+              sync_flush ();
+          }
+        else if (!keep && method != -1)
+          remove_input_file ();
+      }
+
+    if (method == -1) {
+        remove_output_file (false);  /* a no-op for stdout, except tees */
+        return;
+    }
+    tee_active = 0;
+    digest_record (decompress && !to_stdout ? ofname : ifname);
+
+    /* Display statistics */
+    if(verbose) {
+        if (test) {
+            fprintf(stderr, " OK");
+        } else if (decompress) {
+            display_ratio(bytes_out-(bytes_in-header_bytes), bytes_out,stderr);
+        } else {
+            display_ratio(bytes_in-(bytes_out-header_bytes), bytes_in, stderr);
+        }
+        if (recompress)
+          fprintf(stderr, " -- recompressed");
+        else if (!test)
+          fprintf(stderr, " -- %s %s", keep ? "created" : "replaced with",
+                  ofname);
+        fprintf(stderr, "\n");
+    }
+}
+
+/* ========================================================================
+ * Remove the input file, whose output is complete.
+ */
+static void
+remove_input_file ()
+{
+  sigset_t oldset;
+  int unlink_errno;
+  char *ifbase = last_component (ifname);
+  int ufd = atdir_eq (ifname, ifbase - ifname) ? dfd : -1;
+  int res;
+
+  sigprocmask (SIG_BLOCK, &caught_signals, &oldset);
+  remove_ofname_fd = -1;
+  tee_active = 0;
+  res = ufd < 0 ? xunlink (ifname) : unlinkat (ufd, ifbase, 0);
+  unlink_errno = res == 0 ? 0 : errno;
+  sigprocmask (SIG_SETMASK, &oldset, NULL);
+
+  if (unlink_errno)
+    WARN ((stderr, "%s: %s: %s\n", program_name, ifname,
+           strerror (unlink_errno)));
+}
+
+/* ========================================================================
+ * Return true if NAME, the name of a pkzip entry, stays below the
+ * directory it is extracted to: it is relative and has no ".." part.
+ */
+static bool
+safe_entry_name (char const *name)
+{
+  char const *p = name;
+
+  if (!*name || ISSLASH (*name))
+    return false;
+  for (;;)
+    {
+      if (p[0] == '.' && p[1] == '.' && (!p[2] || ISSLASH (p[2])))
+        return false;
+      while (*p && !ISSLASH (*p))
+        p++;
+      if (!*p)
+        return true;
+      p++;
+    }
+}
+
+/* ========================================================================
+ * Set ofname to the file for the entry NAME, next to the input file,
+ * and create the directories it is in.  Return OK or ERROR.
+ */
+static int
+make_entry_name (char const *name)
+{
+  size_t dirlen = last_component (ifname) - ifname;
+  char *p;
+
+  if (!safe_entry_name (name))
+    {
+      WARN ((stderr, "%s: %s: %s: unsafe entry name -- ignored\n",
+             program_name, ifname, name));
+      return ERROR;
+    }
+  if (MAX_PATH_LEN <= dirlen + strlen (name))
+    {
+      WARN ((stderr, "%s: %s: %s: name too long -- ignored\n",
+             program_name, ifname, name));
+      return ERROR;
+    }
+  memcpy (ofname, ifname, dirlen);
+  strcpy (ofname + dirlen, name);
+
+  for (p = ofname + dirlen; *p; p++)
+    if (ISSLASH (*p))
+      {
+        *p = '\0';
+        if (mkdir (ofname, S_IRWXUGO) != 0 && errno != EEXIST)
+          {
+            progerror (ofname);
+            return ERROR;
+          }
+        *p = '/';
+      }
+  return OK;
+}
+
+/* The child processes extracting pkzip entries, and the pipes from
+   them when extracting to standard output, indexed by entry number
+   modulo zip_jobs.  */
+static int zip_jobs;
+static pid_t *zip_pid;
+static int *zip_fd;
+
+/* ========================================================================
+ * In a child process, extract entry I of the pkzip file ifd to OUT,
+ * and exit.
+ */
+_Noreturn static void
+zip_entry_child (int i, int out)
+{
+  char const *name = zip_entry_name (i);
+  size_t len = strlen (ifname);
+  int j;
+
+  /* The parent syncs its own batch of outputs.  */
+  sync_count = 0;
+
+  /* Do not keep the other entries' pipes open.  */
+  for (j = 0; j < zip_jobs; j++)
+    if (0 <= zip_fd[j])
+      close (zip_fd[j]);
+
+  /* Name the entry in messages.  */
+  if (len + 1 + strlen (name) < MAX_PATH_LEN)
+    {
+      ifname[len] = ':';
+      strcpy (ifname + len + 1, name);
+    }
+
+  if (unzip_entry (ifd, out, i) != OK)
+    finish_up_gzip (ERROR);
+  if (!to_stdout)
+    {
+      copy_stat (&istat);
+      if ((synchronous && fsync (out) != 0 && errno != EINVAL)
+          || close (out) != 0)
+        write_error ();
+      remove_ofname_fd = -1;
+    }
+  else if (!test && close (out) != 0)
+    write_error ();
+  do_exit (exit_code);
+}
+
+/* ========================================================================
+ * Start the extraction of entry I of the pkzip file ifd in a child
+ * process, and return its process ID, or 0 if there is nothing to
+ * extract.  If extracting to standard output, set zip_fd to a pipe from
+ * which to read the entry.
+ */
+static pid_t
+start_zip_entry (int i)
+{
+  char const *name = zip_entry_name (i);
+  size_t len;
+  bool ordered = to_stdout && !test;
+  int fd[2];
+  pid_t pid;
+
+  if (!name)
+    {
+      fprintf (stderr,
+               "%s: %s: entry %d not deflated or stored, or encrypted"
+               " -- use unzip\n", program_name, ifname, i + 1);
+      exit_code = ERROR;
+      return 0;
+    }
+  len = strlen (name);
+  if (len && ISSLASH (name[len - 1]))
+    {
+      /* A directory.  */
+      if (!to_stdout && make_entry_name (name) != OK)
+        exit_code = ERROR;
+      return 0;
+    }
+
+  if (ordered)
+    {
+      if (pipe (fd) != 0)
+        {
+          progerror ("pipe");
+          return 0;
+        }
+    }
+  else if (!test)
+    {
+      if (make_entry_name (name) != OK)
+        {
+          exit_code = ERROR;
+          return 0;
+        }
+      if (create_outfile () != OK)
+        {
+          if (exit_code == OK)
+            exit_code = WARNING;
+          return 0;
+        }
+    }
+
+  pid = fork ();
+  if (pid == 0)
+    {
+      if (ordered)
+        close (fd[0]);
+      zip_entry_child (i, ordered ? fd[1] : ofd);
+    }
+  if (ordered)
+    {
+      close (fd[1]);
+      zip_fd[i % zip_jobs] = fd[0];
+    }
+  else if (!test)
+    {
+      remove_ofname_fd = -1;
+      close (ofd);
+    }
+  if (pid < 0)
+    {
+      progerror ("fork");
+      if (ordered)
+        close (fd[0]);
+      else if (!test)
+        xunlink (ofname);
+      return 0;
+    }
+  return pid;
+}
+
+/* ========================================================================
+ * Wait for the child process PID, or any child if PID is -1, that
+ * extracts an entry, compresses a member of --pack or decompresses a
+ * run of members with --batch.  Update exit_code from its status, and
+ * return its process ID.
+ */
+static pid_t
+wait_zip_entry (pid_t pid)
+{
+  int status;
+
+  while ((pid = waitpid (pid, &status, 0)) < 0)
+    if (errno != EINTR)
+      {
+        progerror ("waitpid");
+        do_exit (ERROR);
+      }
+  if (! WIFEXITED (status) || WEXITSTATUS (status) == ERROR)
+    exit_code = ERROR;
+  else if (WEXITSTATUS (status) == WARNING && exit_code == OK)
+    exit_code = WARNING;
+  return pid;
+}
+
+/* ========================================================================
+ * Extract the COUNT entries of the pkzip file ifd, each in a child
+ * process, with as many at a time as there are processors.  Each entry
+ * goes to a file of its own name next to the input file, or to standard
+ * output, in order.  With -t, the entries are only tested.
+ */
+static void
+treat_zip_entries (int count)
+{
+  int i, running = 0;
+  int status = exit_code;
+
+  zip_jobs = num_processors (NPROC_CURRENT_OVERRIDABLE);
+  if (count < zip_jobs)
+    zip_jobs = count;
+  zip_pid = xnmalloc (zip_jobs, sizeof *zip_pid);
+  zip_fd = xnmalloc (zip_jobs, sizeof *zip_fd);
+  for (i = 0; i < zip_jobs; i++)
+    zip_fd[i] = -1;
+  exit_code = OK;
+  throttle_split (zip_jobs + 1);
+
+  if (to_stdout && !test)
+    {
+      /* Keep up to zip_jobs entries in flight, and copy each to the
+         output once the ones before it are done.  */
+      int started = 0;
+      for (i = 0; i < count; i++)
+        {
+          int slot = i % zip_jobs;
+          for (; started < count && started - i < zip_jobs; started++)
+            zip_pid[started % zip_jobs] = start_zip_entry (started);
+          if (zip_pid[slot] <= 0)
+            continue;
+          for (;;)
+            {
+              int n = read_buffer (zip_fd[slot], outbuf, OUTBUFSIZ);
+              if (n <= 0)
+                break;
+              write_buf (STDOUT_FILENO, outbuf, n);
+            }
+          close (zip_fd[slot]);
+          zip_fd[slot] = -1;
+          wait_zip_entry (zip_pid[slot]);
+        }
+    }
+  else
+    {
+      for (i = 0; i < count; i++)
+        {
+          if (running == zip_jobs)
+            {
+              wait_zip_entry (-1);
+              running--;
+            }
+          if (0 < start_zip_entry (i))
+            running++;
+        }
+      while (0 < running--)
+        wait_zip_entry (-1);
+    }
+  throttle_merge (zip_jobs + 1);
+  free (zip_pid);
+  free (zip_fd);
+  zip_jobs = 0;
+  zip_entries_free ();
+
+  if (close (ifd) != 0)
+    read_error ();
+  if (verbose)
+    fprintf (stderr, "%s:\t%s%d entries%s\n", ifname,
+             exit_code == OK && test ? "OK, " : "", count,
+             to_stdout || exit_code != OK ? ""
+             : keep ? " extracted" : " extracted, removed");
+  if (exit_code == OK && !to_stdout && !keep)
+    remove_input_file ();
+  if (status == ERROR || (status == WARNING && exit_code == OK))
+    exit_code = status;
+}
+
+/* ========================================================================
+ * In a child process, compress the file NAME to TMP, and exit.
+ */
+_Noreturn static void
+pack_child (char *name, FILE *tmp)
+{
+  /* The parent copies the member from TMP to standard output.  */
+  if (dup2 (fileno (tmp), STDOUT_FILENO) < 0)
+    {
+      progerror ("dup2");
+      do_exit (ERROR);
+    }
+  fclose (tmp);
+  exit_code = OK;
+  treat_file (name);
+  do_exit (exit_code);
+}
+
+/* ========================================================================
+ * With --pack, compress the COUNT files NAMES to standard output, each
+ * to a member of its own, followed by an index of the members (see
+ * pack.c).  The files are compressed concurrently in child processes,
+ * as many at a time as there are processors, each to a temporary file
+ * that is copied to the output in order.
+ */
+static void
+treat_pack (char **names, int count)
+{
+  int jobs = num_processors (NPROC_CURRENT_OVERRIDABLE);
+  pid_t *pid;
+  FILE **tmp;
+  int i, started = 0;
+  int status = exit_code;
+
+  if (count < jobs)
+    jobs = count;
+  pid = xnmalloc (jobs, sizeof *pid);
+  tmp = xnmalloc (jobs, sizeof *tmp);
+  for (i = 0; i < jobs; i++)
+    tmp[i] = NULL;
+  throttle_split (jobs + 1);
+
+  for (i = 0; i < count; i++)
+    {
+      int slot = i % jobs;
+      off_t len = 0;
+
+      /* Keep up to JOBS files in flight.  */
+      for (; started < count && started - i < jobs; started++)
+        {
+          int s = started % jobs;
+          pid[s] = -1;
+          tmp[s] = tmpfile ();
+          if (tmp[s])
+            pid[s] = fork ();
+          if (pid[s] == 0)
+            {
+              int j;
+              for (j = 0; j < jobs; j++)
+                if (j != s && tmp[j])
+                  fclose (tmp[j]);
+              pack_child (names[started], tmp[s]);
+            }
+          if (pid[s] < 0)
+            {
+              progerror (tmp[s] ? "fork" : "tmpfile");
+              status = ERROR;
+            }
+        }
+
+      if (0 < pid[slot])
+        {
+          exit_code = OK;
+          wait_zip_entry (pid[slot]);
+          if (exit_code != ERROR)
+            {
+              int fd = fileno (tmp[slot]);
+              if (lseek (fd, 0, SEEK_SET) != 0)
+                read_error ();
+              for (;;)
+                {
+                  int n = read_buffer (fd, outbuf, OUTBUFSIZ);
+                  if (n == 0)
+                    break;
+                  if (n < 0)
+                    read_error ();
+                  write_buf (STDOUT_FILENO, outbuf, n);
+                  len += n;
+                }
+            }
+          if (exit_code == ERROR || (exit_code == WARNING && status == OK))
+            status = exit_code;
+        }
+      if (tmp[slot])
+        fclose (tmp[slot]);
+      tmp[slot] = NULL;
+      pack_add (names[i], len);
+    }
+  throttle_merge (jobs + 1);
+  free (pid);
+  free (tmp);
+  pack_finish (STDOUT_FILENO);
+  exit_code = status;
+}
+
+/* ========================================================================
+ * With --batch, the members of a file whose headers give their sizes,
+ * as in the BGZF format, are decompressed in runs of BATCH_SIZE bytes
+ * or so of input, each run by a child process; as many run at a time
+ * as there are processors, each to a temporary file that is copied to
+ * the output in order.  batch_off[i] is the offset of member i, and
+ * batch_off[batch_count] the size of the file.
+ */
+#define BATCH_SIZE (1L << 20)
+#define BATCH_MAX_EXTRA 256   /* longest extra field looked into */
+
+static off_t *batch_off;
+static size_t batch_count;
+static size_t batch_alloc;
+
+/* Return the size of the member whose extra field of XLEN bytes is
+   EXTRA, as given by a "BC" subfield, or 0 if there is none.  */
+static off_t
+bgzf_size (uch const *extra, unsigned xlen)
+{
+  while (4 <= xlen)
+    {
+      unsigned n = extra[2] | (extra[3] << 8);
+      if (xlen - 4 < n)
+        break;
+      if (extra[0] == 'B' && extra[1] == 'C' && n == 2)
+        return (extra[4] | (extra[5] << 8)) + 1;
+      extra += 4 + n;
+      xlen -= 4 + n;
+    }
+  return 0;
+}
+
+/* ========================================================================
+ * Read the headers of the regular file IN, which is ifile_size bytes
+ * long, to find its members without decompressing them.  Return true
+ * if they all give their size and there are enough of them for --batch
+ * to be worth it.
+ */
+static bool
+batch_scan (int in)
+{
+  uch h[10 + 2 + BATCH_MAX_EXTRA];
+  off_t off = 0;
+
+  batch_count = 0;
+  while (off < ifile_size)
+    {
+      unsigned xlen;
+      off_t size;
+
+      if (pread (in, h, 12, off) != 12 || memcmp (h, GZIP_MAGIC, 2) != 0
+          || h[2] != DEFLATED || ! (h[3] & EXTRA_FIELD))
+        return false;
+      xlen = h[10] | (h[11] << 8);
+      if (BATCH_MAX_EXTRA < xlen || pread (in, h + 12, xlen, off + 12) != xlen)
+        return false;
+      size = bgzf_size (h + 12, xlen);
+      if (size < 12 + xlen + 2 + 8 || ifile_size - off < size)
+        return false;
+      if (batch_count + 1 >= batch_alloc)
+        batch_off = x2nrealloc (batch_off, &batch_alloc, sizeof *batch_off);
+      batch_off[batch_count++] = off;
+      off += size;
+    }
+  batch_off[batch_count] = off;
+  return (BATCH_SIZE < ifile_size
+          && 1 < num_processors (NPROC_CURRENT_OVERRIDABLE));
+}
+
+/* ========================================================================
+ * In a child process, decompress the members of the input file from
+ * offset START to END to TMP, and exit.
+ */
+_Noreturn static void
+batch_child (off_t start, off_t end, FILE *tmp)
+{
+  struct stat st;
+  int in;
+
+  /* The parent syncs its own batch of outputs.  */
+  sync_count = 0;
+  in = open (ifname, O_RDONLY | O_BINARY);
+
+  /* The parent's descriptor shares its offset with the other children,
+     so read the file through a descriptor of its own.  */
+  if (in < 0 || fstat (in, &st) != 0
+      || st.st_ino != istat.st_ino || st.st_dev != istat.st_dev
+      || lseek (in, start, SEEK_SET) != start)
+    {
+      progerror (ifname);
+      do_exit (ERROR);
+    }
+  exit_code = OK;
+  digest_mode = DIGEST_OFF;
+  pipeline = false;
+  remove_ofname_fd = -1;
+  clear_bufs ();
+  ifd = in;
+  ofd = fileno (tmp);
+  while (start + bytes_in - insize + inptr < end)
+    {
+      method = get_method (in);
+      if (method < 0 || unzip (in, ofd) != OK)
+        do_exit (ERROR);
+    }
+  do_exit (exit_code);
+}
+
+/* ========================================================================
+ * Decompress the members found by batch_scan in IN to OUT.  Return OK
+ * or ERROR.
+ */
+static int
+treat_batch (int in, int out)
+{
+  size_t jobs = num_processors (NPROC_CURRENT_OVERRIDABLE);
+  size_t *first;            /* the first member of each run */
+  size_t runs = 0;
+  size_t i, started = 0;
+  pid_t *pid;
+  FILE **tmp;
+  int status = OK;
+  int prev_status = exit_code;
+
+  /* Split the members in runs of about BATCH_SIZE bytes.  */
+  first = xnmalloc (batch_count + 1, sizeof *first);
+  for (i = 0; i < batch_count; i++)
+    if (!runs || BATCH_SIZE <= batch_off[i] - batch_off[first[runs - 1]])
+      first[runs++] = i;
+  first[runs] = batch_count;
+
+  if (runs < jobs)
+    jobs = runs;
+  pid = xnmalloc (jobs, sizeof *pid);
+  tmp = xnmalloc (jobs, sizeof *tmp);
+  for (i = 0; i < jobs; i++)
+    tmp[i] = NULL;
+  throttle_split (jobs + 1);
+
+  for (i = 0; i < runs && status != ERROR; i++)
+    {
+      size_t slot = i % jobs;
+
+      /* Keep up to JOBS runs in flight.  */
+      for (; started < runs && started - i < jobs; started++)
+        {
+          size_t s = started % jobs;
+          pid[s] = -1;
+          tmp[s] = tmpfile ();
+          if (tmp[s])
+            pid[s] = fork ();
+          if (pid[s] == 0)
+            {
+              size_t j;
+              for (j = 0; j < jobs; j++)
+                if (j != s && tmp[j])
+                  fclose (tmp[j]);
+              batch_child (batch_off[first[started]],
+                           batch_off[first[started + 1]], tmp[s]);
+            }
+          if (pid[s] < 0)
+            progerror (tmp[s] ? "fork" : "tmpfile");
+        }
+
+      if (pid[slot] < 0)
+        status = ERROR;
+      else
+        {
+          exit_code = OK;
+          wait_zip_entry (pid[slot]);
+          if (exit_code != ERROR)
+            {
+              int fd = fileno (tmp[slot]);
+              if (lseek (fd, 0, SEEK_SET) != 0)
+                read_error ();
+              for (;;)
+                {
+                  int n = read_buffer (fd, outbuf, OUTBUFSIZ);
+                  if (n == 0)
+                    break;
+                  if (n < 0)
+                    read_error ();
+                  write_buf (out, outbuf, n);
+                }
+            }
+          if (exit_code == ERROR || (exit_code == WARNING && status == OK))
+            status = exit_code;
+        }
+      if (tmp[slot])
+        fclose (tmp[slot]);
+      tmp[slot] = NULL;
+    }
+
+  /* After an error, stop the runs still in flight.  */
+  for (; i < started; i++)
+    {
+      size_t slot = i % jobs;
+      if (0 < pid[slot])
+        {
+          kill (pid[slot], SIGTERM);
+          wait_zip_entry (pid[slot]);
+        }
+      if (tmp[slot])
+        fclose (tmp[slot]);
+    }
+  throttle_merge (jobs + 1);
+  free (first);
+  free (pid);
+  free (tmp);
+  bytes_in = ifile_size;
+  exit_code = prev_status;
+  if (status == ERROR || (status == WARNING && exit_code == OK))
+    exit_code = status;
+  return status == ERROR ? ERROR : OK;
+}
+
+/* ========================================================================
+ * Add the output file OUT, which is complete, to the batch of outputs to
+ * be synced.  Return true if this is done, and false if OUT must be
+ * synced on its own.
+ */
+static bool
+sync_add (int out)
+{
+#if HAVE_SYNCFS
+  struct stat st;
+  int i;
+
+  if (fstat (out, &st) != 0)
+    return false;
+  for (i = 0; i < sync_fs_count; i++)
+    if (sync_dev[i] == st.st_dev)
+      return true;
+  if (i == SYNC_MAX_FS)
+    {
+      sync_flush ();
+      i = 0;
+    }
+  sync_fd[i] = dup (out);
+  if (sync_fd[i] < 0)
+    return false;
+  sync_dev[i] = st.st_dev;
+  sync_fs_count = i + 1;
+  return true;
+#else
+  return false;
+#endif
+}
+
+/* ========================================================================
+ * Sync the file systems of the batch of outputs, and then remove the
+ * inputs of the batch.  If a file system cannot be synced, keep all the
+ * inputs.
+ */
+static void
+sync_flush ()
+{
+  int i, n = sync_count;
+  bool synced = true;
+
+  sync_count = 0;
+  for (i = 0; i < sync_fs_count; i++)
+    {
+#if HAVE_SYNCFS
+      if (synced && syncfs (sync_fd[i]) != 0)
+        {
+          progerror ("syncfs");
+          synced = false;
+        }
+#endif
+      close (sync_fd[i]);
+    }
+  sync_fs_count = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      char *name = sync_iname[i];
+      if (name && synced && xunlink (name) != 0)
+        WARN ((stderr, "%s: %s: %s\n", program_name, name, strerror (errno)));
+      free (name);
+      sync_iname[i] = NULL;
+    }
+}
+
+/* ========================================================================
+ * Prepare for reading the header of a file to be recompressed: the new
+ * member gets the original name and timestamp of the old one, if any.
+ */
+static void
+start_recompress ()
+{
+    ifile_size = -1;          /* the uncompressed size is unknown */
+    time_stamp.tv_nsec = -1;
+    recompress_name[0] = '\0';
+    orig_name = recompress_name;
+    save_orig_name = 0;
+}
+
+/* ========================================================================
+ * Decompress the remaining members of 'in' and compress the result to
+ * 'out' at the current level.  The input header has already been read
+ * by get_method.  A child process runs the decompressor and feeds the
+ * compressor through a pipe, so neither side waits for the other to
+ * finish its buffer and no temporary copy of the data is made.
+ * Return OK, or ERROR if either side failed.
+ */
+static int
+recompress_members (int in, int out)
+{
+    int fd[2];
+    int status;
+    int r;
+    pid_t pid;
+
+    /* Do not store gzip data under a .Z, .zip or .z (pack) name.  */
+    if (!to_stdout && (method != DEFLATED || last_member)) {
+        fprintf (stderr, "%s: %s: not in gzip format -- use -c\n",
+                 program_name, ifname);
+        exit_code = ERROR;
+        return ERROR;
+    }
+    if (pipe (fd) != 0) {
+        progerror ("pipe");
+        return ERROR;
+    }
+    throttle_split (2);
+    pid = fork ();
+    if (pid < 0) {
+        progerror ("fork");
+        throttle_merge (2);
+        close (fd[0]);
+        close (fd[1]);
+        return ERROR;
+    }
+
+    if (pid == 0) {
+        /* The decompressor: never remove the output file on error,
+         * the parent takes care of it.
+         */
+        close (fd[0]);
+        remove_ofname_fd = -1;
+        decompress = 1;
+        for (;;) {
+            if ((*work)(in, fd[1]) != OK)
+                do_exit (ERROR);
+            if (input_eof ())
+                break;
+            if (get_method (in) < 0)
+                break;          /* error message already emitted */
+        }
+        if (close (fd[1]) != 0)
+            write_error ();
+        do_exit (exit_code);
+    }
+
+    close (fd[1]);
+    clear_bufs ();
+    r = zip (fd[0], out);
+    close (fd[0]);
+    ifd = in;
+    throttle_merge (2);
+
+    while (waitpid (pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            progerror ("waitpid");
+            return ERROR;
+        }
+    }
+    if (! WIFEXITED (status) || WEXITSTATUS (status) == ERROR) {
+        exit_code = ERROR;
+        return ERROR;
+    }
+    if (WEXITSTATUS (status) == WARNING && exit_code == OK)
+        exit_code = WARNING;
+    return r;
+}
+
+/* ========================================================================
+ * Rename the finished --recompress output file over the input file.
+ * Return OK or ERROR.
+ */
+static int
+replace_input_file ()
+{
+    sigset_t oldset;
+    int rename_errno;
+    char *ifbase = last_component (ifname);
+    char *ofbase = last_component (ofname);
+    int rfd = atdir_eq (ifname, ifbase - ifname) ? dfd : -1;
+    int res;
+
+    sigprocmask (SIG_BLOCK, &caught_signals, &oldset);
+    res = (rfd < 0 ? rename (ofname, ifname)
+           : renameat (rfd, ofbase, rfd, ifbase));
+    rename_errno = res == 0 ? 0 : errno;
+    if (res == 0)
+        remove_ofname_fd = -1;
+    sigprocmask (SIG_SETMASK, &oldset, NULL);
+
+    if (rename_errno) {
+        errno = rename_errno;
+        progerror (ifname);
+        return ERROR;
+    }
+    strcpy (ofname, ifname);
+    return OK;
+}
+
+static void
+volatile_strcpy (char volatile *dst, char const volatile *src)
+{
+  while ((*dst++ = *src++))
+    continue;
+}
+
+/* ========================================================================
+ * Create the output file NAME of a --tee-levels or --raw-copy output and
+ * register it for removal on error.  Return its descriptor, or -1.
+ */
+static int
+create_tee_output (char const *name)
+{
+  int fd;
+
+  if (!signal_handlers_installed)
+    {
+      signal_handlers_installed = true;
+      install_signal_handlers ();
+    }
+
+  for (;;)
+    {
+      int open_errno;
+      sigset_t oldset;
+
+      sigprocmask (SIG_BLOCK, &caught_signals, &oldset);
+      fd = open (name, O_WRONLY | O_CREAT | O_EXCL | O_BINARY,
+                 S_IRUSR | S_IWUSR);
+      open_errno = errno;
+      if (0 <= fd)
+        {
+          volatile_strcpy (tee_name[tee_active], name);
+          tee_pid[tee_active] = 0;
+          tee_active++;
+        }
+      sigprocmask (SIG_SETMASK, &oldset, NULL);
+
+      if (0 <= fd)
+        return fd;
+      if (open_errno == EEXIST && force)
+        {
+          if (xunlink ((char *) name) == 0)
+            continue;
+          open_errno = errno;
+        }
+      if (open_errno == EEXIST)
+        {
+          WARN ((stderr, "%s: %s already exists -- not overwritten\n",
+                 program_name, name));
+        }
+      else
+        {
+          errno = open_errno;
+          progerror (name);
+        }
+      return -1;
+    }
+}
+
+/* ========================================================================
+ * The child process of an extra output: read the input from IN, compress
+ * it at level LVL (or copy it if LVL is 0) to OUT, whose name is NAME,
+ * and exit.  If FROM_FILE, give OUT the attributes of the input file.
+ */
+_Noreturn static void
+tee_child (int in, int out, int lvl, char const *name, bool from_file)
+{
+  tee_active = 0;
+  tee_count = 0;
+  remove_ofname_fd = out;
+  volatile_strcpy (remove_ofname, name);
+  strcpy (ofname, name);
+  ifd = in;
+  ofd = out;
+  clear_bufs ();
+
+  if (lvl)
+    {
+      level = lvl;
+      zip (in, out);
+    }
+  else if (fill_inbuf (1) != EOF)
+    {
+      inptr = 0;                /* copy the byte read by fill_inbuf too */
+      copy (in, out);
+    }
+
+  if (from_file)
+    copy_stat (&istat);
+  if ((synchronous && fsync (out) != 0 && errno != EINVAL)
+      || close (out) != 0)
+    write_error ();
+  remove_ofname_fd = -1;
+  do_exit (exit_code);
+}
+
+/* ========================================================================
+ * Create the extra outputs of --tee-levels and --raw-copy and start their
+ * child processes.  FROM_FILE is false when reading standard input.
+ * Return OK or ERROR; on error, the caller should call remove_output_file
+ * and finish_tees.
+ */
+static int
+start_tees (bool from_file)
+{
+  int i, j;
+
+  for (i = 0; i < tee_count; i++)
+    tee_fd[i] = -1;
+  throttle_split (tee_count + 1);
+
+  for (i = 0; i < tee_count; i++)
+    {
+      char name[MAX_PATH_LEN];
+      int len;
+      int fd[2];
+      int out;
+      pid_t pid;
+
+      if (!tee_levels[i])
+        strcpy (name, raw_copy);
+      else if (!from_file)
+        {
+          fprintf (stderr, "%s: --tee-levels needs file operands\n",
+                   program_name);
+          exit_code = ERROR;
+          return ERROR;
+        }
+      else if ((len = snprintf (name, sizeof name, "%s.%d%s",
+                                ifname, tee_levels[i], z_suffix)) < 0
+               || sizeof name <= (size_t) len)
+        {
+          WARN ((stderr, "%s: %s: file name too long\n",
+                 program_name, ifname));
+          return ERROR;
+        }
+
+      out = create_tee_output (name);
+      if (out < 0)
+        return ERROR;
+      if (pipe (fd) != 0)
+        {
+          progerror ("pipe");
+          close (out);
+          return ERROR;
+        }
+
+      pid = fork ();
+      if (pid == 0)
+        {
+          close (fd[1]);
+          for (j = 0; j < i; j++)
+            close (tee_fd[j]);
+          if (ifd != STDIN_FILENO)
+            close (ifd);
+          if (0 <= remove_ofname_fd)
+            close (remove_ofname_fd);
+          tee_child (fd[0], out, tee_levels[i], name, from_file);
+        }
+      close (fd[0]);
+      close (out);
+      if (pid < 0)
+        {
+          progerror ("fork");
+          close (fd[1]);
+          return ERROR;
+        }
+      tee_pid[tee_active - 1] = pid;
+      tee_fd[i] = fd[1];
+    }
+  return OK;
 }
 
 /* ========================================================================
- * Compress or decompress the given file
+ * Copy the LEN bytes of input in BUF to the extra outputs, if any.
  */
-static void
-treat_file (char *iname)
+void
+tee_input (char const *buf, unsigned len)
 {
-    /* Accept "-" as synonym for stdin */
-    if (strequ(iname, "-")) {
-        int cflag = to_stdout;
-        treat_stdin();
-        to_stdout = cflag;
-        return;
-    }
+  int i;
 
-    /* Check if the input file is present, set ifname and istat: */
-    ifd = open_input_file (iname, &istat);
-    if (ifd < 0)
-      return;
+  for (i = 0; i < tee_count; i++)
+    {
+      char const *p = buf;
+      unsigned n = len;
 
-    /* If the input name is that of a directory, recurse or ignore: */
-    if (S_ISDIR(istat.st_mode)) {
-#if ! NO_DIR
-        if (recursive) {
-            treat_dir (ifd, iname);
-            /* Warning: ifname is now garbage */
-            return;
+      while (n)
+        {
+          ssize_t w = write (tee_fd[i], p, n);
+          if (w < 0)
+            {
+              char fname[MAX_PATH_LEN];
+              volatile_strcpy (fname, tee_name[i]);
+              progerror (fname);
+              finish_up_gzip (ERROR);
+            }
+          p += w;
+          n -= w;
         }
-#endif
-        close (ifd);
-        WARN ((stderr, "%s: %s is a directory -- ignored\n",
-               program_name, ifname));
-        return;
     }
+}
 
-    if (! to_stdout)
-      {
-        if (! S_ISREG (istat.st_mode))
-          {
-            WARN ((stderr,
-                   "%s: %s is not a directory or a regular file - ignored\n",
-                   program_name, ifname));
-            close (ifd);
-            return;
-          }
-        if (istat.st_mode & S_ISUID)
-          {
-            WARN ((stderr, "%s: %s is set-user-ID on execution - ignored\n",
-                   program_name, ifname));
-            close (ifd);
-            return;
-          }
-        if (istat.st_mode & S_ISGID)
-          {
-            WARN ((stderr, "%s: %s is set-group-ID on execution - ignored\n",
-                   program_name, ifname));
-            close (ifd);
-            return;
-          }
+/* ========================================================================
+ * Close the pipes to the extra outputs and wait for their children.
+ * Return OK if all of them succeeded, ERROR otherwise.
+ */
+static int
+finish_tees ()
+{
+  int i;
+  int r = OK;
 
-        if (! force)
-          {
-            if (istat.st_mode & S_ISVTX)
-              {
-                WARN ((stderr,
-                       "%s: %s has the sticky bit set - file ignored\n",
-                       program_name, ifname));
-                close (ifd);
-                return;
-              }
-            if (2 <= istat.st_nlink)
-              {
-                WARN ((stderr, "%s: %s has %lu other link%s -- file ignored\n",
-                       program_name, ifname,
-                       (unsigned long int) istat.st_nlink - 1,
-                       istat.st_nlink == 2 ? "" : "s"));
-                close (ifd);
-                return;
-              }
-          }
+  throttle_merge (tee_count + 1);
+  for (i = 0; i < tee_count; i++)
+    if (0 <= tee_fd[i])
+      {
+        close (tee_fd[i]);
+        tee_fd[i] = -1;
       }
 
-    get_input_size_and_time ();
-
-    /* Generate output file name. For -r and (-t or -l), skip files
-     * without a valid gzip suffix (check done in make_ofname).
-     */
-    if (to_stdout && !test) {
-        strcpy(ofname, "stdout");
-
-    } else if (make_ofname() != OK) {
-        close (ifd);
-        return;
-    }
-
-    clear_bufs(); /* clear input and output buffers */
-    part_nb = 0;
+  for (i = 0; i < tee_count; i++)
+    {
+      pid_t pid = tee_pid[i];
+      int status;
 
-    if (decompress) {
-        method = get_method(ifd); /* updates ofname if original given */
-        if (method < 0) {
-            close(ifd);
-            return;               /* error message already emitted */
+      if (pid <= 0)
+        continue;
+      while (waitpid (pid, &status, 0) < 0)
+        if (errno != EINTR)
+          {
+            progerror ("waitpid");
+            status = ERROR << 8;
+            break;
+          }
+      tee_pid[i] = 0;
+      if (! WIFEXITED (status) || WEXITSTATUS (status) == ERROR)
+        {
+          exit_code = ERROR;
+          r = ERROR;
         }
+      else if (WEXITSTATUS (status) == WARNING && exit_code == OK)
+        exit_code = WARNING;
     }
+  return r;
+}
 
-    /* If compressing to a file, check if ofname is not ambiguous
-     * because the operating system truncates names. Otherwise, generate
-     * a new ofname and save the original name in the compressed file.
-     */
-    if (to_stdout) {
-        ofd = STDOUT_FILENO;
-        /* Keep remove_ofname_fd negative.  */
-    } else {
-        if (create_outfile() != OK) return;
+/* ========================================================================
+ * With --verify, start the child process that tests the compressed data
+ * about to be written to the output.  Return OK or ERROR.
+ */
+int
+verify_start ()
+{
+  int fd[2];
+  int i;
+  pid_t pid;
 
-        if (!decompress && save_orig_name && !verbose && !quiet) {
-            fprintf(stderr, "%s: %s compressed to %s\n",
-                    program_name, ifname, ofname);
-        }
+  if (!verify)
+    return OK;
+  if (pipe (fd) != 0)
+    {
+      progerror ("pipe");
+      return ERROR;
     }
-    /* Keep the name even if not truncated except with --no-name: */
-    if (!save_orig_name) save_orig_name = !no_name;
-
-    if (verbose && !list) {
-        fprintf(stderr, "%s:\t", ifname);
+  throttle_split (2);
+  pid = fork ();
+  if (pid < 0)
+    {
+      progerror ("fork");
+      throttle_merge (2);
+      close (fd[0]);
+      close (fd[1]);
+      return ERROR;
     }
 
-    /* Actually do the compression/decompression. Loop over zipped members.
-     */
-    for (;;) {
-        if ((*work)(ifd, ofd) != OK) {
-            method = -1; /* force cleanup */
+  if (pid == 0)
+    {
+      /* The tester: its only output is its messages and exit status.  */
+      close (fd[1]);
+      for (i = 0; i < tee_count; i++)
+        if (0 <= tee_fd[i])
+          close (tee_fd[i]);
+      tee_count = 0;
+      sync_count = 0;
+      remove_ofname_fd = -1;
+      verify_in = fd[0];
+      exit_code = OK;
+      decompress = test = to_stdout = 1;
+      part_nb = 0;
+      ifd = fd[0];
+      clear_bufs ();
+      method = get_method (fd[0]);
+      if (method < 0)
+        do_exit (ERROR);      /* error message already emitted */
+      for (;;)
+        {
+          if (unzip (fd[0], -1) != OK)
+            do_exit (ERROR);
+          if (input_eof ())
+            break;
+          if (get_method (fd[0]) < 0)
             break;
         }
+      do_exit (exit_code);
+    }
 
-        if (input_eof ())
-          break;
+  close (fd[0]);
+  verify_fd = fd[1];
+  verify_pid = pid;
+  return OK;
+}
 
-        method = get_method(ifd);
-        if (method < 0) break;    /* error message already emitted */
+/* ========================================================================
+ * Copy the LEN bytes of compressed output at BUF to the --verify child.
+ */
+void
+verify_output (char const *buf, unsigned len)
+{
+  while (0 <= verify_fd && len)
+    {
+      ssize_t w = write (verify_fd, buf, len);
+      if (w < 0)
+        {
+          /* The child reports its own error, if any.  */
+          close (verify_fd);
+          verify_fd = -1;
+          break;
+        }
+      buf += w;
+      len -= w;
     }
+}
 
-    if (close (ifd) != 0)
-      read_error ();
+/* ========================================================================
+ * Done writing the compressed output: wait for the --verify child, if
+ * any.  Return OK if it found the output intact, ERROR otherwise.
+ */
+int
+verify_finish ()
+{
+  pid_t pid = verify_pid;
+  int status;
 
-    if (list)
+  if (pid <= 0)
+    return OK;
+  if (0 <= verify_fd)
+    close (verify_fd);
+  verify_fd = -1;
+  while (waitpid (pid, &status, 0) < 0)
+    if (errno != EINTR)
       {
-        do_list (method);
-        return;
+        progerror ("waitpid");
+        status = ERROR << 8;
+        break;
       }
+  verify_pid = 0;
+  throttle_merge (2);
+  if (! WIFEXITED (status) || WEXITSTATUS (status) != OK)
+    {
+      fprintf (stderr, "%s: %s: verification failed\n", program_name, ifname);
+      exit_code = ERROR;
+      return ERROR;
+    }
+  return OK;
+}
 
-    if (!to_stdout)
-      {
-        copy_stat (&istat);
-
-        if ((synchronous
-             && ((0 <= dfd && fdatasync (dfd) != 0 && errno != EINVAL)
-                 || (fsync (ofd) != 0 && errno != EINVAL)))
-            || close (ofd) != 0)
-          write_error ();
-
-        if (!keep)
-          {
-            sigset_t oldset;
-            int unlink_errno;
-            char *ifbase = last_component (ifname);
-            int ufd = atdir_eq (ifname, ifbase - ifname) ? dfd : -1;
-            int res;
-
-            sigprocmask (SIG_BLOCK, &caught_signals, &oldset);
-            remove_ofname_fd = -1;
-            res = ufd < 0 ? xunlink (ifname) : unlinkat (ufd, ifbase, 0);
-            unlink_errno = res == 0 ? 0 : errno;
-            sigprocmask (SIG_SETMASK, &oldset, NULL);
-
-            if (unlink_errno)
-              WARN ((stderr, "%s: %s: %s\n", program_name, ifname,
-                     strerror (unlink_errno)));
-          }
-      }
+/* ========================================================================
+ * With --pipeline, start the child process that codes the blocks (see
+ * trees.c), or when decompressing, that copies the matches and writes
+ * the output (see inflate.c), after writing what is in the output
+ * buffer.  Return OK or ERROR.
+ */
+int
+coder_start ()
+{
+  int to[2], from[2];
+  int i;
+  pid_t pid;
 
-    if (method == -1) {
-        if (!to_stdout)
-          remove_output_file (false);
-        return;
+  if (!pipeline)
+    return OK;
+  flush_outbuf ();
+  if (pipe (to) != 0)
+    {
+      progerror ("pipe");
+      return ERROR;
+    }
+  if (pipe (from) != 0)
+    {
+      progerror ("pipe");
+      close (to[0]);
+      close (to[1]);
+      return ERROR;
+    }
+  throttle_split (2);
+  pid = fork ();
+  if (pid < 0)
+    {
+      progerror ("fork");
+      throttle_merge (2);
+      close (to[0]);
+      close (to[1]);
+      close (from[0]);
+      close (from[1]);
+      return ERROR;
     }
 
-    /* Display statistics */
-    if(verbose) {
-        if (test) {
-            fprintf(stderr, " OK");
-        } else if (decompress) {
-            display_ratio(bytes_out-(bytes_in-header_bytes), bytes_out,stderr);
-        } else {
-            display_ratio(bytes_in-(bytes_out-header_bytes), bytes_in, stderr);
-        }
-        if (!test)
-          fprintf(stderr, " -- %s %s", keep ? "created" : "replaced with",
-                  ofname);
-        fprintf(stderr, "\n");
+  if (pid == 0)
+    {
+      /* The coder: it writes the compressed data, and the parent the
+         rest of the output.  */
+      close (to[1]);
+      close (from[0]);
+      for (i = 0; i < tee_count; i++)
+        if (0 <= tee_fd[i])
+          close (tee_fd[i]);
+      tee_count = 0;
+      sync_count = 0;
+      remove_ofname_fd = -1;
+      exit_code = OK;
+      if (decompress)
+        inflate_tokens (to[0], from[1]);
+      else
+        ct_code_blocks (to[0], from[1]);
+      do_exit (exit_code);
     }
+
+  close (to[0]);
+  close (from[1]);
+  coder_fd = to[1];
+  coder_reply = from[0];
+  coder_pid = pid;
+  return OK;
 }
 
-static void
-volatile_strcpy (char volatile *dst, char const volatile *src)
+/* ========================================================================
+ * Done with the blocks: wait for the --pipeline child, if any.  Return
+ * OK if it succeeded, ERROR otherwise.
+ */
+int
+coder_finish ()
 {
-  while ((*dst++ = *src++))
-    continue;
+  pid_t pid = coder_pid;
+  int status;
+
+  if (pid <= 0)
+    return OK;
+  close (coder_fd);
+  close (coder_reply);
+  coder_fd = coder_reply = -1;
+  while (waitpid (pid, &status, 0) < 0)
+    if (errno != EINTR)
+      {
+        progerror ("waitpid");
+        status = ERROR << 8;
+        break;
+      }
+  coder_pid = 0;
+  throttle_merge (2);
+  if (! WIFEXITED (status) || WEXITSTATUS (status) != OK)
+    {
+      exit_code = ERROR;
+      return ERROR;
+    }
+  return OK;
 }
 
 /* ========================================================================
@@ -1034,17 +2791,22 @@ volatile_strcpy (char volatile *dst, char const volatile *src)
  * Sets save_orig_name to true if the file name has been truncated.
  * IN assertions: the input file has already been open (ifd is set) and
  *   ofname has already been updated if there was an original name.
- * OUT assertions: ifd and ofd are closed in case of error.
+ * OUT assertions: ofd is closed in case of error.
  */
 static int
 create_outfile ()
 {
-  static bool signal_handlers_installed;
   int name_shortened = 0;
-  int flags = (O_WRONLY | O_CREAT | O_EXCL
+  /* --cache-dir and --resumable read the compressed data back from the
+     output.  A resumed output already exists.  */
+  int flags = (((cache_dir || resume_interval) && !decompress
+                ? O_RDWR : O_WRONLY)
+               | (resuming ? 0 : O_CREAT | O_EXCL)
                | (ascii && decompress ? 0 : O_BINARY));
   char const *base = ofname;
   int atfd = AT_FDCWD;
+  char *tmp_suffix = recompress ? ofname + strlen (ofname) : NULL;
+  int tmp_count = 0;
 
   if (!keep)
     {
@@ -1068,11 +2830,15 @@ create_outfile ()
       int open_errno;
       sigset_t oldset;
 
+      if (tmp_suffix)
+        sprintf (tmp_suffix, ".tmp%d", tmp_count++);
       volatile_strcpy (remove_ofname, ofname);
 
       sigprocmask (SIG_BLOCK, &caught_signals, &oldset);
       remove_ofname_fd = ofd = openat (atfd, base, flags, S_IRUSR | S_IWUSR);
       open_errno = errno;
+      if (resuming)
+        remove_ofname_fd = -1;  /* keep it if interrupted again */
       sigprocmask (SIG_SETMASK, &oldset, NULL);
 
       if (0 <= ofd)
@@ -1082,23 +2848,25 @@ create_outfile ()
         {
 #ifdef ENAMETOOLONG
         case ENAMETOOLONG:
+          if (tmp_suffix)
+            {
+              errno = open_errno;
+              write_error ();
+            }
           shorten_name (ofname);
           name_shortened = 1;
           break;
 #endif
 
         case EEXIST:
+          if (tmp_suffix)
+            break;  /* try the next temporary name */
           if (check_ofname () != OK)
-            {
-              close (ifd);
-              return ERROR;
-            }
+            return ERROR;
           break;
 
         default:
           write_error ();
-          close (ifd);
-          return ERROR;
         }
     }
 
@@ -1344,7 +3112,7 @@ make_ofname ()
     /* strip a version number if any and get the gzip suffix if present: */
     suff = get_suffix(ofname);
 
-    if (decompress) {
+    if (decompress || recompress) {
         if (suff == NULL) {
             /* With -t or -l, try all files (even without .gz suffix)
              * except with -r (behave as with just -dr).
@@ -1359,6 +3127,14 @@ make_ofname ()
             }
             return WARNING;
         }
+        /* The output replaces the input.  create_outfile appends
+         * a temporary suffix of at most TMP_SUFFIX_LEN bytes.
+         */
+        if (recompress) {
+            if (sizeof ofname <= strlen (ofname) + TMP_SUFFIX_LEN)
+                goto name_too_long;
+            return OK;
+        }
         /* Make a special case for .tgz and .taz: */
         strlwr(suff);
         if (strequ(suff, ".tgz") || strequ(suff, ".taz")) {
@@ -1477,6 +3253,7 @@ get_method (int in)
     part_nb++;                   /* number of parts in gzip file */
     header_bytes = 0;
     last_member = 0;
+    digest_member = false;
     /* assume multiple members in gzip file except for record oriented I/O */
 
     if (memcmp(magic, GZIP_MAGIC, 2) == 0
@@ -1545,6 +3322,8 @@ get_method (int in)
 
         if ((flags & EXTRA_FIELD) != 0) {
             uch lenbuf[2];
+            uch *extra;
+            unsigned int i;
             unsigned int len = lenbuf[0] = get_byte ();
             len |= (lenbuf[1] = get_byte ()) << 8;
             if (verbose) {
@@ -1553,22 +3332,32 @@ get_method (int in)
             }
             if (flags & HEADER_CRC)
               updcrc (lenbuf, 2);
-            discard_input_bytes (len, flags);
+            extra = xmalloc (len + 1);
+            for (i = 0; i < len; i++)
+              extra[i] = get_byte ();
+            if (flags & HEADER_CRC)
+              updcrc (extra, len);
+            digest_expect (extra, len);
+            free (extra);
         }
 
         /* Get original file name if it was truncated */
         if ((flags & ORIG_NAME) != 0) {
-            if (no_name || (to_stdout && !list) || part_nb > 1) {
+            if (no_name || (to_stdout && !list && !recompress)
+                || part_nb > 1) {
                 /* Discard the old name */
                 discard_input_bytes (-1, flags);
             } else {
-                /* Copy the base name. Keep a directory prefix intact. */
-                char *p = gzip_base_name (ofname);
+                /* Copy the base name. Keep a directory prefix intact.
+                 * With --recompress, keep it aside for the new header.
+                 */
+                char *buf = recompress ? recompress_name : ofname;
+                char *p = recompress ? buf : gzip_base_name (buf);
                 char *base = p;
                 for (;;) {
                     *p = (char) get_byte ();
                     if (*p++ == '\0') break;
-                    if (p >= ofname+sizeof(ofname)) {
+                    if (p >= buf + MAX_PATH_LEN) {
                         gzip_error ("corrupted input -- file name too large");
                     }
                 }
@@ -1634,7 +3423,8 @@ get_method (int in)
         method = LZHED;
         last_member = 1;
 
-    } else if (force && to_stdout && !list) { /* pass input unchanged */
+    } else if (force && to_stdout && !list && !recompress) {
+        /* pass input unchanged */
         method = STORED;
         work = copy;
         if (imagic1 != EOF)
@@ -2005,6 +3795,13 @@ do_exit (int exitcode)
 
     if (in_exit) exit(exitcode);
     in_exit = 1;
+    /* A child inherits the batch of its parent, but must not sync it or
+       remove its inputs.  */
+    if (sync_count && sync_owner == getpid ())
+      sync_flush ();
+    if (0 <= verify_in)
+      while (0 < read (verify_in, inbuf, INBUFSIZ))
+        continue;
     free(env);
     env  = NULL;
     FREE(inbuf);
@@ -2048,16 +3845,39 @@ remove_output_file (bool signals_already_blocked)
       volatile_strcpy (fname, remove_ofname);
       xunlink (fname);
     }
+  while (0 < tee_active)
+    {
+      char fname[MAX_PATH_LEN];
+      int i = --tee_active;
+      if (0 < tee_pid[i])
+        kill (tee_pid[i], SIGTERM);
+      volatile_strcpy (fname, tee_name[i]);
+      xunlink (fname);
+    }
   if (!signals_already_blocked)
     sigprocmask (SIG_SETMASK, &oldset, NULL);
 }
 
+/* ========================================================================
+ * Do not remove the output file if gzip fails or is interrupted from now
+ * on: it can be resumed (see resume.c).
+ */
+void
+keep_output_file ()
+{
+  remove_ofname_fd = -1;
+}
+
 /* ========================================================================
  * Error handler.
  */
 void
 finish_up_gzip (int exitcode)
 {
+  if (0 < verify_pid)
+    kill (verify_pid, SIGTERM);
+  if (0 < coder_pid)
+    kill (coder_pid, SIGTERM);
   if (0 <= remove_ofname_fd)
     remove_output_file (false);
   do_exit (exitcode);
@@ -2073,6 +3893,10 @@ abort_gzip ()
 static void
 abort_gzip_signal (int sig)
 {
+   if (0 < verify_pid)
+     kill (verify_pid, SIGTERM);
+   if (0 < coder_pid)
+     kill (coder_pid, SIGTERM);
    remove_output_file (true);
    signal (sig, SIG_DFL);
    raise (sig);
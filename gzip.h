@@ -192,6 +192,8 @@ extern int level;          /* compression level */
 extern int test;           /* check .z file integrity */
 extern int to_stdout;      /* output to stdout (-c) */
 extern int save_orig_name; /* set if original name must be saved */
+extern int last_member;    /* set for .zip and .Z files */
+extern char *orig_name;    /* name to save instead of ifname, or NULL */
 
 #define get_byte()  (inptr < insize ? inbuf[inptr++] : fill_inbuf(0))
 #define try_byte()  (inptr < insize ? inbuf[inptr++] : fill_inbuf(1))
@@ -264,10 +266,77 @@ extern int verbose;        /* be verbose (-v) */
 extern int zip        (int in, int out);
 extern int file_read  (char *buf,  unsigned size);
 
+        /* in cache.c */
+extern char *cache_dir;
+extern int  cache_lookup (int in);
+extern int  cache_copy   (int fd, int out);
+extern void cache_store  (int out, off_t header_len);
+
+        /* in resume.c */
+#ifndef RESUME_INTERVAL
+#  define RESUME_INTERVAL ((off_t) 1 << 26) /* default for --resumable */
+#endif
+extern off_t resume_interval;
+extern off_t resume_next;
+extern bool resuming;
+extern void resume_load       (struct timespec mtime);
+extern void resume_restore    (int in, int out);
+extern void resume_checkpoint (void);
+extern void resume_finish     (bool complete);
+
+        /* in index.c */
+#ifndef ACCESS_INTERVAL
+#  define ACCESS_INTERVAL ((off_t) 1 << 20) /* default for --access-points */
+#endif
+extern off_t index_interval;
+extern void index_start  (int out);
+extern void index_point  (void);
+extern void index_finish (bool complete);
+
+        /* in digest.c */
+enum { DIGEST_NONE, DIGEST_SHA256 };          /* digest_type */
+enum { DIGEST_OFF, DIGEST_INPUT, DIGEST_OUTPUT }; /* digest_mode */
+extern int digest_type;
+extern int digest_mode;
+extern bool digest_member;
+extern bool digest_option   (char const *arg);
+extern int  digest_open     (void);
+extern void digest_start    (int mode);
+extern void digest_update   (void const *buf, unsigned len);
+extern void digest_finish   (void);
+extern void digest_record   (char const *name);
+extern bool digest_fillable (int out);
+extern void digest_field    (void);
+extern void digest_fill     (int out);
+extern void digest_expect   (uch const *extra, unsigned len);
+extern void digest_member_update (void const *buf, unsigned len);
+extern int  digest_check    (void);
+
+        /* in join.c */
+extern int  join_member (int in, int out);
+extern void join_finish (int out);
+
+        /* in throttle.c */
+extern bool background;
+extern off_t background_rate;
+extern void background_start (void);
+extern void throttle         (unsigned n);
+extern void throttle_split   (int n);
+extern void throttle_merge   (int n);
+
+        /* in pack.c */
+extern void pack_add    (char const *name, off_t length);
+extern void pack_finish (int out);
+extern int  pack_seek   (int in, char const *name);
+
         /* in unzip.c */
 extern ulg unzip_crc;
 extern int unzip      (int in, int out);
 extern int check_zipfile (int in);
+extern int zip_entries (int in);
+extern char const *zip_entry_name (int i);
+extern int unzip_entry (int in, int out, int i);
+extern void zip_entries_free (void);
 
         /* in unpack.c */
 extern int unpack     (int in, int out);
@@ -278,6 +347,13 @@ extern int unlzh      (int in, int out);
         /* in gzip.c */
 _Noreturn extern void finish_up_gzip (int);
 _Noreturn extern void abort_gzip (void);
+extern void tee_input (char const *buf, unsigned len);
+extern int verify_start (void);
+extern void verify_output (char const *buf, unsigned len);
+extern int verify_finish (void);
+extern int coder_start (void);
+extern int coder_finish (void);
+extern void keep_output_file (void);
 
         /* in deflate.c */
 extern off_t gzip_deflate (int pack_level);
@@ -286,6 +362,11 @@ extern off_t gzip_deflate (int pack_level);
 extern void ct_init     (ush *attr, int *method);
 extern int  ct_tally    (int dist, int lc);
 extern off_t flush_block (char *buf, ulg stored_len, int pad, int eof);
+extern int coder_fd;
+extern int coder_reply;
+extern void ct_code_blocks (int in, int out);
+extern void coder_write (int fd, void const *buf, size_t n);
+extern bool coder_read (int fd, void *buf, size_t n);
 
         /* in bits.c */
 #ifdef IBM_Z_DFLTCC
@@ -306,6 +387,7 @@ extern ulg  getcrc        (void) _GL_ATTRIBUTE_PURE;
 extern void setcrc        (ulg c);
 extern void clear_bufs    (void);
 extern int  fill_inbuf    (int eof_ok);
+extern off_t in_offset;
 extern void flush_outbuf  (void);
 extern void flush_window  (void);
 extern void write_buf     (int fd, voidp buf, unsigned cnt);
@@ -324,6 +406,10 @@ extern void display_ratio (off_t num, off_t den, FILE *file);
 
         /* in inflate.c */
 extern int gzip_inflate (void);
+extern void inflate_flush (void);
+extern void inflate_tokens (int in, int out);
+extern off_t inflate_final;
+extern off_t inflate_end;
 
         /* in dfltcc.c */
 #ifdef IBM_Z_DFLTCC
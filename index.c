@@ -0,0 +1,130 @@
+/* index.c -- access points for random access to compressed data
+
+   Copyright (C) 2025 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* With --access-points, the input is compressed in segments of
+ * index_interval bytes, as with --resumable: each segment is deflated
+ * on its own, with an empty window, and ends with an empty stored block
+ * that ends it on a byte boundary.  So decompression can start at the
+ * beginning of any segment, with no history, as raw deflate data.
+ *
+ * When the output is a file, FILE.gz.idx lists the access points, one
+ * per line: the offset of the segment in FILE.gz and in the
+ * uncompressed data, in decimal.  The first line is for the start of
+ * the deflate data, just after the gzip header.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tailor.h"
+#include "gzip.h"
+#include "xalloc.h"
+
+#ifndef MAX_PATH_LEN
+#  define MAX_PATH_LEN   1024 /* max pathname length */
+#endif
+
+#define INDEX_SUFFIX ".idx"
+
+off_t index_interval;       /* --access-points, or 0 */
+
+static bool index_wanted;   /* write the index of the current output */
+static off_t *points;       /* offsets in the output and in the input */
+static size_t n_points;     /* number of access points */
+static size_t points_alloc; /* and room for them in points */
+
+/* ===========================================================================
+ * Record an access point at the current offsets.
+ */
+static void
+add_point (void)
+{
+  if (!index_wanted)
+    return;
+  if (n_points == points_alloc)
+    points = x2nrealloc (points, &points_alloc, 2 * sizeof *points);
+  points[2 * n_points] = bytes_out + outcnt;
+  points[2 * n_points + 1] = bytes_in;
+  n_points++;
+}
+
+/* ===========================================================================
+ * Start compressing in segments, after the gzip header.  The index is
+ * written only if the output OUT is not standard output.
+ */
+void
+index_start (int out)
+{
+  index_wanted = out != STDOUT_FILENO;
+  n_points = 0;
+  add_point ();
+  resume_next = index_interval;
+}
+
+/* ===========================================================================
+ * The segment ending at the current input offset, which is resume_next,
+ * is complete: record the access point that follows it.
+ */
+void
+index_point ()
+{
+  add_point ();
+  resume_next += index_interval;
+}
+
+/* ===========================================================================
+ * Done with the output.  If it is COMPLETE, write its index to ofname
+ * with the suffix ".idx".  A problem with the index is reported as a
+ * warning.
+ */
+void
+index_finish (bool complete)
+{
+  char name[MAX_PATH_LEN];
+  FILE *f;
+  size_t i;
+
+  resume_next = -1;
+  if (!index_wanted)
+    return;
+  index_wanted = false;
+  if (!complete)
+    return;
+  if (strlen (ofname) + sizeof INDEX_SUFFIX > sizeof name)
+    {
+      WARN ((stderr, "%s: %s: name too long for an index\n",
+             program_name, ofname));
+      return;
+    }
+  strcpy (name, ofname);
+  strcat (name, INDEX_SUFFIX);
+
+  f = fopen (name, "w");
+  if (f)
+    {
+      for (i = 0; i < n_points; i++)
+        fprintf (f, "%jd %jd\n", (intmax_t) points[2 * i],
+                 (intmax_t) points[2 * i + 1]);
+      if (fclose (f) == 0)
+        return;
+    }
+  WARN ((stderr, "%s: %s: %s\n", program_name, name, strerror (errno)));
+}
@@ -117,6 +117,7 @@
 #include <config.h>
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "tailor.h"
 #include "gzip.h"
@@ -139,6 +140,18 @@ struct huft {
 };
 
 
+/* Multi-literal lookup table entry.  When a lookup in the first level
+   literal/length table would decode a literal using fewer bits than the
+   table is indexed with, the remaining index bits may well contain
+   another short literal code, or two.  An entry of this table gives all
+   the literals that the index decodes fully, so that they are stored
+   together.  n is 0 if the index does not start with two literals. */
+struct mlit {
+  uch n;                /* number of literals: 0, 2 or 3 */
+  uch b;                /* number of bits in all their codes */
+  uch c[4];             /* the literals, padded for a four-byte store */
+};
+
 /* Function prototypes */
 static int huft_free (struct huft *);
 
@@ -156,6 +169,28 @@ static bool fresh;
 #define wp outcnt
 #define flush_output(w) (fresh = false, wp = (w), flush_window ())
 
+/* With --pipeline, the decoded symbols are not stored in the window but
+   sent as tokens through coder_fd to a child process, which copies the
+   matches, writes the output and updates the crc (see inflate_tokens).
+   Only the window position is tracked here, to check the distances.  A
+   token is a literal byte, END_TOKEN, or MATCH_TOKEN plus the length
+   less 3 followed by the distance.  */
+#define TOKENS 0x4000
+#define MATCH_TOKEN 256
+#define END_TOKEN 512
+static ush tokens[TOKENS];
+static unsigned tokcnt;
+
+/* Start a new window, like flush_output (W) but for --pipeline.  */
+#define next_window(w) (0 <= coder_fd ? (void) (fresh = false) \
+                        : (void) flush_output (w))
+
+/* What the child sends back after END_TOKEN.  */
+struct inflate_result {
+  ulg crc;
+  off_t bytes_out;
+};
+
 /* Tables for deflate from PKZIP's appnote.txt. */
 static unsigned border[] = {    /* Order of the bit length code lengths */
         16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
@@ -211,6 +246,14 @@ static ush cpdext[] = {         /* Extra bits for distance codes */
 static ulg bb;                         /* bit buffer */
 static unsigned bk;                    /* bits in bit buffer */
 
+/* The bit offsets in the input of the header of the last block of the
+   entry inflated last, and of its end, for --join.  */
+off_t inflate_final;
+off_t inflate_end;
+
+/* The bit offset in the input of the next bit to read.  */
+#define BIT_OFFSET() (((bytes_in - insize + inptr) << 3) - bk)
+
 static ush mask_bits[] = {
     0x0000,
     0x0001, 0x0003, 0x0007, 0x000f, 0x001f, 0x003f, 0x007f, 0x00ff,
@@ -269,6 +312,36 @@ static int dbits = 6;   /* bits in base distance lookup table */
 static unsigned hufts;  /* track memory usage */
 
 
+/* Multi-literal tables are made for first level tables of at most
+   MLBITS bits. */
+#define MLBITS 9
+
+
+/* Producers that flush often, or use --rsyncable, tend to send the same
+   dynamic code lengths block after block.  The decoding tables of the
+   last HCACHE_SIZE distinct sets of code lengths are kept, so that such
+   blocks need not build them again.  hlru[] lists the entries, most
+   recently used first. */
+#define HCACHE_SIZE 4
+struct hcache {
+  unsigned nl, nd;      /* numbers of codes, or 0 if the entry is unused */
+  unsigned hash;        /* hash of lens[] */
+  uch lens[288+32];     /* literal/length and distance code lengths */
+  struct huft *tl;      /* literal/length code table */
+  struct huft *td;      /* distance code table */
+  int bl, bd;           /* lookup bits for tl and td */
+  bool use_mlit;        /* whether mlit[] is worth using */
+  struct mlit mlit[1 << MLBITS];
+};
+static struct hcache hcache[HCACHE_SIZE];
+static struct hcache *hlru[HCACHE_SIZE] =
+  { hcache, hcache + 1, hcache + 2, hcache + 3 };
+
+/* The fixed tables are built on first use and kept. */
+static struct huft *fixed_tl, *fixed_td;
+static int fixed_bl, fixed_bd;
+
+
 static int
 huft_build(
 unsigned *b,            /* code lengths in bits (all assumed <= BMAX) */
@@ -511,12 +584,124 @@ huft_free(struct huft *t)
 }
 
 
+/* Fill in the multi-literal table MLIT from the first level
+   literal/length table TL, which decodes BL bits.  Return nonzero if it
+   is worth using, that is, if the codes are short enough that at least
+   a quarter of all bit patterns start with two or more literals. */
+static int
+mlit_build(struct huft *tl, int bl, struct mlit *mlit)
+{
+  unsigned x;           /* index into tl[] and mlit[] */
+  unsigned z;           /* number of entries */
+  unsigned hits;        /* entries with several literals */
+
+  if (bl > MLBITS)
+    return 0;
+  z = 1 << bl;
+  hits = 0;
+  for (x = 0; x < z; x++)
+  {
+    struct mlit *m = mlit + x;
+    unsigned y = x;     /* the index bits not decoded yet */
+    unsigned used = 0;  /* the bits decoded */
+
+    /* Codes of at most bl - used bits are decoded correctly by
+       tl[y], as their entries repeat for all values of the other bits. */
+    m->n = 0;
+    while (m->n < 3)
+    {
+      struct huft *t = tl + y;
+      if (t->e != 16 || used + t->b > (unsigned)bl)
+        break;
+      m->c[m->n++] = (uch)t->v.n;
+      used += t->b;
+      y >>= t->b;
+    }
+    m->b = (uch)used;
+    if (m->n < 2)
+      m->n = 0;
+    else
+      hits++;
+  }
+  return z <= 4 * hits;
+}
+
+
+
+/* Send the tokens so far to the child of --pipeline.  */
+static void
+send_tokens (void)
+{
+  coder_write (coder_fd, &tokcnt, sizeof tokcnt);
+  coder_write (coder_fd, tokens, tokcnt * sizeof *tokens);
+  tokcnt = 0;
+}
+
+/* Add the N literals at C to the tokens.  */
+static void
+put_literals (uch const *c, unsigned n)
+{
+  while (n--)
+    {
+      tokens[tokcnt++] = *c++;
+      if (tokcnt == TOKENS)
+        send_tokens ();
+    }
+}
+
+/* Add a match of length N at distance DIST to the tokens.  */
+static void
+put_match (unsigned n, unsigned dist)
+{
+  if (TOKENS - 1 <= tokcnt)
+    send_tokens ();
+  tokens[tokcnt++] = MATCH_TOKEN + n - 3;
+  tokens[tokcnt++] = dist;
+  if (tokcnt == TOKENS)
+    send_tokens ();
+}
+
+/* Copy N bytes from D to W in the window, flushing it when it is full.
+   Return the new window position.  */
+static unsigned
+copy_match (unsigned w, unsigned d, unsigned n)
+{
+  unsigned e;
+
+  do {
+    n -= (e = (e = WSIZE - ((d &= WSIZE-1) > w ? d : w)) > n ? n : e);
+#ifndef DEBUG
+    if (e <= (d < w ? w - d : d - w))
+    {
+      memcpy(slide + w, slide + d, e);
+      w += e;
+      d += e;
+    }
+    else                      /* do it slow to avoid memcpy() overlap */
+#endif
+      do {
+        slide[w++] = slide[d++];
+        Tracevv((stderr, "%c", slide[w-1]));
+      } while (--e);
+    if (w == WSIZE)
+    {
+      flush_output(w);
+      w = 0;
+    }
+  } while (n);
+  return w;
+}
+
+
+
 /* tl, td:   literal/length and distance decoder tables */
 /* bl, bd:   number of bits decoded by tl[] and td[] */
+/* tm:       multi-literal table for tl, or NULL */
 /* gzip_inflate (decompress) the codes in a deflated (compressed) block.
    Return an error code or zero if it all goes ok. */
 static int
-inflate_codes(struct huft *tl, struct huft *td, int bl, int bd)
+inflate_codes(struct huft *tl, struct huft *td, int bl, int bd,
+              struct mlit const *tm)
 {
   register unsigned e;  /* table entry flag/number of extra bits */
   unsigned n, d;        /* length and index for copy */
@@ -538,6 +723,21 @@ inflate_codes(struct huft *tl, struct huft *td, int bl, int bd)
   for (;;)                      /* do until end of block */
   {
     NEEDBITS((unsigned)bl)
+    if (tm && w < WSIZE - 3)
+    {
+      struct mlit const *m = tm + ((unsigned)b & ml);
+      if (m->n)                 /* then it's two or three literals */
+      {
+        if (0 <= coder_fd)
+          put_literals(m->c, m->n);
+        else
+          memcpy(slide + w, m->c, 4);
+        Tracevv((stderr, "%.*s", m->n, (char const *) m->c));
+        w += m->n;
+        DUMPBITS(m->b)
+        continue;
+      }
+    }
     if ((e = (t = tl + ((unsigned)b & ml))->e) > 16)
       do {
         if (e == 99)
@@ -549,11 +749,15 @@ inflate_codes(struct huft *tl, struct huft *td, int bl, int bd)
     DUMPBITS(t->b)
     if (e == 16)                /* then it's a literal */
     {
-      slide[w++] = (uch)t->v.n;
-      Tracevv((stderr, "%c", slide[w-1]));
-      if (w == WSIZE)
+      uch c = (uch)t->v.n;
+      if (0 <= coder_fd)
+        put_literals(&c, 1);
+      else
+        slide[w] = c;
+      Tracevv((stderr, "%c", c));
+      if (++w == WSIZE)
       {
-        flush_output(w);
+        next_window(w);
         w = 0;
       }
     }
@@ -587,27 +791,15 @@ inflate_codes(struct huft *tl, struct huft *td, int bl, int bd)
       Tracevv ((stderr, "\\[%u,%u]", w - d, n));
 
       /* do the copy */
-      do {
-        n -= (e = (e = WSIZE - ((d &= WSIZE-1) > w ? d : w)) > n ? n : e);
-#ifndef DEBUG
-        if (e <= (d < w ? w - d : d - w))
-        {
-          memcpy(slide + w, slide + d, e);
-          w += e;
-          d += e;
-        }
-        else                      /* do it slow to avoid memcpy() overlap */
-#endif
-          do {
-            slide[w++] = slide[d++];
-            Tracevv((stderr, "%c", slide[w-1]));
-          } while (--e);
-        if (w == WSIZE)
-        {
-          flush_output(w);
-          w = 0;
-        }
-      } while (n);
+      if (0 <= coder_fd)
+      {
+        put_match(n, w - d);
+        if (WSIZE <= w + n)
+          fresh = false;
+        w = (w + n) & (WSIZE-1);
+      }
+      else
+        w = copy_match(w, d, n);
     }
   }
 
@@ -658,10 +850,16 @@ inflate_stored(void)
   while (n--)
   {
     NEEDBITS(8)
-    slide[w++] = (uch)b;
-    if (w == WSIZE)
+    if (0 <= coder_fd)
     {
-      flush_output(w);
+      uch c = (uch)b;
+      put_literals(&c, 1);
+    }
+    else
+      slide[w] = (uch)b;
+    if (++w == WSIZE)
+    {
+      next_window(w);
       w = 0;
     }
     DUMPBITS(8)
@@ -691,6 +889,9 @@ inflate_fixed(void)
   unsigned l[288];      /* length list for huft_build */
 
 
+  if (fixed_tl)
+    return inflate_codes(fixed_tl, fixed_td, fixed_bl, fixed_bd, NULL);
+
   /* set up literal table */
   for (i = 0; i < 144; i++)
     l[i] = 8;
@@ -716,15 +917,15 @@ inflate_fixed(void)
   }
 
 
-  /* decompress until an end-of-block code */
-  if (inflate_codes(tl, td, bl, bd))
-    return 1;
+  /* keep the decoding tables for later blocks */
+  fixed_tl = tl;
+  fixed_td = td;
+  fixed_bl = bl;
+  fixed_bd = bd;
 
 
-  /* free the decoding tables, return */
-  huft_free(tl);
-  huft_free(td);
-  return 0;
+  /* decompress until an end-of-block code */
+  return inflate_codes(tl, td, bl, bd, NULL);
 }
 
 
@@ -746,6 +947,8 @@ inflate_dynamic(void)
   unsigned nb;          /* number of bit length codes */
   unsigned nl;          /* number of literal/length codes */
   unsigned nd;          /* number of distance codes */
+  unsigned h;           /* hash of the code lengths */
+  struct hcache *c;     /* cache entry for the code lengths */
 #ifdef PKZIP_BUG_WORKAROUND
   unsigned ll[288+32];  /* literal/length and distance code lengths */
 #else
@@ -864,6 +1067,32 @@ inflate_dynamic(void)
   bk = k;
 
 
+  /* look for decoding tables built for the same code lengths */
+  h = nl;
+  for (j = 0; j < n; j++)
+    h = h * 31 + ll[j];
+  for (i = 0; i < HCACHE_SIZE; i++)
+  {
+    c = hlru[i];
+    if (c->hash == h && c->nl == nl && c->nd == nd)
+    {
+      for (j = 0; j < n && c->lens[j] == ll[j]; j++)
+        ;
+      if (j == n)
+        break;
+    }
+  }
+  if (i < HCACHE_SIZE)
+  {
+    Trace ((stderr, " (cached tables)"));
+    for (; i; i--)
+      hlru[i] = hlru[i - 1];
+    hlru[0] = c;
+    return inflate_codes(c->tl, c->td, c->bl, c->bd,
+                         c->use_mlit ? c->mlit : NULL) ? 1 : 0;
+  }
+
+
   /* build the decoding tables for literal/length and distance codes */
   bl = lbits;
   if ((i = huft_build(ll, nl, 257, cplens, cplext, &tl, &bl)) != 0)
@@ -891,16 +1120,30 @@ inflate_dynamic(void)
   }
 
 
+  /* replace the least recently used tables with these */
+  c = hlru[HCACHE_SIZE - 1];
+  if (c->nl)
   {
-    /* decompress until an end-of-block code */
-    int err = inflate_codes(tl, td, bl, bd) ? 1 : 0;
+    huft_free(c->tl);
+    huft_free(c->td);
+  }
+  for (i = HCACHE_SIZE - 1; i; i--)
+    hlru[i] = hlru[i - 1];
+  hlru[0] = c;
+  c->nl = nl;
+  c->nd = nd;
+  c->hash = h;
+  for (j = 0; j < n; j++)
+    c->lens[j] = ll[j];
+  c->tl = tl;
+  c->td = td;
+  c->bl = bl;
+  c->bd = bd;
+  c->use_mlit = mlit_build(tl, bl, c->mlit);
 
-    /* free the decoding tables */
-    huft_free(tl);
-    huft_free(td);
 
-    return err;
-  }
+  /* decompress until an end-of-block code */
+  return inflate_codes(tl, td, bl, bd, c->use_mlit ? c->mlit : NULL) ? 1 : 0;
 }
 
 
@@ -973,6 +1216,7 @@ gzip_inflate ()
   h = 0;
   do {
     hufts = 0;
+    inflate_final = BIT_OFFSET();
     if ((r = inflate_block(&e)) != 0)
       return r;
     if (hufts > h)
@@ -982,6 +1226,7 @@ gzip_inflate ()
   /* Undo too much lookahead. The next read will be byte aligned so we
    * can discard unused bits in the last meaningful byte.
    */
+  inflate_end = BIT_OFFSET();
   while (bk >= 8) {
     bk -= 8;
     inptr--;
@@ -995,3 +1240,71 @@ gzip_inflate ()
   Trace ((stderr, "<%u> ", h));
   return 0;
 }
+
+
+
+/* With --pipeline, send the remaining tokens to the child and wait for
+   it to write all the data decoded so far; this is how flush_window
+   ends a member in the parent.  */
+void
+inflate_flush ()
+{
+  struct inflate_result res;
+
+  tokens[tokcnt++] = END_TOKEN;
+  send_tokens ();
+  if (!coder_read (coder_reply, &res, sizeof res))
+    gzip_error ("decoding process failed");
+  setcrc (res.crc);
+  bytes_out = res.bytes_out;
+  wp = 0;
+}
+
+
+
+/* In the child process of --pipeline, copy the matches of the tokens
+   read from IN to the window, and write it as flush_window does.  After
+   each END_TOKEN, which ends a member, send the crc and bytes_out to
+   OUT.  */
+void
+inflate_tokens (int in, int out)
+{
+  unsigned cnt;         /* number of tokens read */
+  unsigned i;           /* index of the next token */
+  unsigned w = 0;       /* current window position */
+
+  while (coder_read (in, &cnt, sizeof cnt))
+  {
+    if (! (cnt <= TOKENS && coder_read (in, tokens, cnt * sizeof *tokens)))
+      gzip_error ("bad tokens from the decoding process");
+    for (i = 0; i < cnt; i++)
+    {
+      unsigned t = tokens[i];
+      if (t < MATCH_TOKEN)
+      {
+        slide[w++] = (uch)t;
+        if (w == WSIZE)
+        {
+          flush_output(w);
+          w = 0;
+        }
+      }
+      else if (t == END_TOKEN)
+      {
+        struct inflate_result res;
+        flush_output(w);
+        w = 0;
+        res.crc = getcrc ();
+        res.bytes_out = bytes_out;
+        coder_write (out, &res, sizeof res);
+        updcrc (NULL, 0);       /* for the next member */
+      }
+      else
+      {
+        if (i + 1 == cnt || END_TOKEN < t)
+          gzip_error ("bad tokens from the decoding process");
+        w = copy_match(w, w - tokens[++i], t - MATCH_TOKEN + 3);
+      }
+    }
+  }
+}
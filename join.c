@@ -0,0 +1,234 @@
+/* join.c -- join gzip members into one without recompressing them
+
+   Copyright (C) 2025 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* With --join, the deflate data of all the input members is written
+ * as a single member.  Each input member is inflated without output,
+ * only to find where its last block starts and where its data ends,
+ * and to check it.  Its data is then read again and copied, with the
+ * last-block bit of its last block cleared.  If the data does not end
+ * on a byte boundary, an empty stored block follows to get to one, so
+ * that the data of the next member can be copied as it is.  The joined
+ * data ends with an empty fixed block that is the last one.  The CRC of
+ * the whole is combined from those of the members.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "tailor.h"
+#include "gzip.h"
+
+static bool join_started;   /* the header has been written */
+static ulg join_crc;        /* CRC of the data joined so far */
+static off_t join_len;      /* and its length */
+
+/* ===========================================================================
+ * Write the N bytes at BUF to OUT.
+ */
+static void
+join_write (int out, uch const *buf, size_t n)
+{
+  while (n)
+    {
+      ssize_t w = write (out, buf, n);
+      if (w < 0)
+        write_error ();
+      buf += w;
+      n -= w;
+    }
+}
+
+/* ===========================================================================
+ * Write the header of the joined member to OUT, once.  It has no file
+ * name or timestamp, as those of the inputs may differ.
+ */
+static void
+join_start (int out)
+{
+  static uch const header[10] =
+    { 0x1f, 0x8b, DEFLATED, 0, 0, 0, 0, 0, 0, OS_CODE };
+
+  if (join_started)
+    return;
+  join_write (out, header, sizeof header);
+  join_started = true;
+}
+
+/* Multiply the vector VEC by the 32x32 bit matrix MAT.  */
+static ulg
+gf2_times (ulg const *mat, ulg vec)
+{
+  ulg sum = 0;
+  for (; vec; vec >>= 1, mat++)
+    if (vec & 1)
+      sum ^= *mat;
+  return sum;
+}
+
+/* Set SQUARE to the square of the matrix MAT.  */
+static void
+gf2_square (ulg *square, ulg const *mat)
+{
+  int n;
+  for (n = 0; n < 32; n++)
+    square[n] = gf2_times (mat, mat[n]);
+}
+
+/* ===========================================================================
+ * Return the CRC of the data with CRC CRC1 followed by the LEN2 bytes of
+ * data with CRC CRC2, computed as in zlib by applying LEN2 zero bytes to
+ * CRC1 with the powers of the matrix of the shift register.
+ */
+static ulg
+crc_combine (ulg crc1, ulg crc2, off_t len2)
+{
+  ulg even[32], odd[32];
+  ulg row = 1;
+  int n;
+
+  if (len2 <= 0)
+    return crc1;
+  odd[0] = 0xedb88320L;         /* one zero bit */
+  for (n = 1; n < 32; n++, row <<= 1)
+    odd[n] = row;
+  gf2_square (even, odd);       /* two zero bits */
+  gf2_square (odd, even);       /* four zero bits */
+
+  do
+    {
+      gf2_square (even, odd);   /* first time, one zero byte */
+      if (len2 & 1)
+        crc1 = gf2_times (even, crc1);
+      len2 >>= 1;
+      if (!len2)
+        break;
+      gf2_square (odd, even);
+      if (len2 & 1)
+        crc1 = gf2_times (odd, crc1);
+      len2 >>= 1;
+    }
+  while (len2);
+
+  return crc1 ^ crc2;
+}
+
+/* ===========================================================================
+ * Add the member of IN whose header was just read by get_method to the
+ * joined member written to OUT.  Return OK or ERROR.
+ */
+int
+join_member (int in, int out)
+{
+  off_t start = bytes_in - insize + inptr; /* where the deflate data is */
+  off_t len = bytes_out;
+  off_t origin = lseek (in, 0, SEEK_CUR);
+  off_t pos, end, final;
+  int save_test = test;
+  int r;
+
+  if (method != DEFLATED || last_member)
+    {
+      fprintf (stderr, "%s: %s: not in gzip format -- cannot join\n",
+               program_name, ifname);
+      exit_code = ERROR;
+      return ERROR;
+    }
+
+  if (origin < 0)
+    {
+      fprintf (stderr, "%s: %s: not a regular file -- cannot join\n",
+               program_name, ifname);
+      exit_code = ERROR;
+      return ERROR;
+    }
+
+  /* The offsets above count from where IN was when gzip started to
+   * read it, which is not the start of the file if standard input was
+   * left elsewhere.
+   */
+  origin -= bytes_in;
+
+  /* Check the member and find its last block and its end.  */
+  test = 1;
+  r = unzip (in, out);
+  test = save_test;
+  if (r != OK)
+    return ERROR;
+  len = bytes_out - len;
+  final = inflate_final;
+  end = inflate_end;
+
+  join_start (out);
+  for (pos = start; pos < (end + 7) >> 3; )
+    {
+      /* Leave room in the window for the empty stored block.  */
+      off_t left = ((end + 7) >> 3) - pos;
+      ssize_t n = left < 2 * WSIZE - 8 ? left : 2 * WSIZE - 8;
+      ssize_t got = pread (in, window, n, origin + pos);
+      if (got != n)
+        {
+          if (got < 0)
+            read_error ();
+          gzip_error ("unexpected end of file");
+        }
+      if (pos <= final >> 3 && final >> 3 < pos + n)
+        window[(final >> 3) - pos] &= ~(1 << (final & 7));
+      pos += n;
+      if (pos == (end + 7) >> 3 && (end & 7))
+        {
+          /* Fill the last byte with the header of an empty stored block,
+           * which then takes the next one as well if it does not fit.
+           */
+          window[n - 1] &= (1 << (end & 7)) - 1;
+          if (5 < (end & 7))
+            window[n++] = 0;
+          window[n++] = 0;
+          window[n++] = 0;
+          window[n++] = 0xff;
+          window[n++] = 0xff;
+        }
+      join_write (out, window, n);
+    }
+
+  join_crc = crc_combine (join_crc, unzip_crc, len);
+  join_len += len;
+  return OK;
+}
+
+/* ===========================================================================
+ * End the joined member written to OUT.
+ */
+void
+join_finish (int out)
+{
+  uch buf[2 + 8];
+
+  join_start (out);
+  buf[0] = 0x03;                /* empty fixed block, the last one */
+  buf[1] = 0x00;
+  buf[2] = join_crc & 0xff;
+  buf[3] = (join_crc >> 8) & 0xff;
+  buf[4] = (join_crc >> 16) & 0xff;
+  buf[5] = (join_crc >> 24) & 0xff;
+  buf[6] = join_len & 0xff;
+  buf[7] = (join_len >> 8) & 0xff;
+  buf[8] = (join_len >> 16) & 0xff;
+  buf[9] = (join_len >> 24) & 0xff;
+  join_write (out, buf, sizeof buf);
+}
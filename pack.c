@@ -0,0 +1,193 @@
+/* pack.c -- index of the members of a gzip file made by --pack
+
+   Copyright (C) 2025 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* With --pack, each file is compressed to a member of its own on
+ * standard output, and a last member with no data indexes them.  Its
+ * header has a comment (FCOMMENT) made of lines of text:
+ *
+ *   gzip-pack 1
+ *   OFFSET LENGTH NAME      for each member, offsets in decimal
+ *   end INDEX PACKLEN       fixed width, 20 digits each
+ *
+ * OFFSET and INDEX (the offset of the index member) are relative to the
+ * start of the output of --pack, which is PACKLEN bytes long.  As the
+ * index member is last and ends with a known number of bytes, it is
+ * found from the end of the file, even if that output was appended to
+ * something else.  Decompressing the whole file gives the concatenation
+ * of the files, as the index member decompresses to nothing.
+ */
+
+#include <config.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tailor.h"
+#include "gzip.h"
+#include "intprops.h"
+#include "xalloc.h"
+
+#define PACK_INDEX_MAGIC "gzip-pack 1\n"
+#define PACK_END_FORMAT "end %20jd %20jd\n"
+#define PACK_END_LEN (4 + 20 + 1 + 20 + 1)
+
+/* The end of the index member: the end of the comment, an empty fixed
+   block that is the last one, and the CRC and length of no data.  */
+#define PACK_TAIL_LEN (1 + 2 + 8)
+
+static char *pack_index;    /* the index so far */
+static size_t pack_index_len;
+static size_t pack_index_alloc;
+static off_t pack_len;      /* length of the output so far */
+
+/* Append the LEN bytes at P to the index.  */
+static void
+index_append (char const *p, size_t len)
+{
+  while (pack_index_alloc - pack_index_len < len)
+    pack_index = x2nrealloc (pack_index, &pack_index_alloc, 1);
+  memcpy (pack_index + pack_index_len, p, len);
+  pack_index_len += len;
+}
+
+/* ===========================================================================
+ * The member of the file NAME, LENGTH bytes long, has just been written
+ * after the others: add it to the index.
+ */
+void
+pack_add (char const *name, off_t length)
+{
+  char buf[2 * INT_BUFSIZE_BOUND (intmax_t) + 1];
+  off_t offset = pack_len;
+
+  pack_len += length;
+  if (!length)
+    return;
+  if (strchr (name, '\n'))
+    {
+      WARN ((stderr, "%s: %s: name contains a newline -- not indexed\n",
+             program_name, name));
+      return;
+    }
+  if (!pack_index_len)
+    index_append (PACK_INDEX_MAGIC, sizeof PACK_INDEX_MAGIC - 1);
+  index_append (buf, sprintf (buf, "%jd %jd ", (intmax_t) offset,
+                              (intmax_t) length));
+  index_append (name, strlen (name));
+  index_append ("\n", 1);
+}
+
+/* ===========================================================================
+ * Write the index member to OUT, after the members of the files.
+ */
+void
+pack_finish (int out)
+{
+  uch header[10] = { 0x1f, 0x8b, DEFLATED, COMMENT, 0, 0, 0, 0, 0, OS_CODE };
+  uch tail[PACK_TAIL_LEN] = { 0, 0x03, 0x00 };
+  char end[PACK_END_LEN + 1];
+  off_t index_offset = pack_len;
+
+  if (!pack_index_len)
+    index_append (PACK_INDEX_MAGIC, sizeof PACK_INDEX_MAGIC - 1);
+  pack_len += sizeof header + pack_index_len + PACK_END_LEN + sizeof tail;
+  sprintf (end, PACK_END_FORMAT, (intmax_t) index_offset, (intmax_t) pack_len);
+
+  write_buf (out, header, sizeof header);
+  write_buf (out, pack_index, pack_index_len);
+  write_buf (out, end, PACK_END_LEN);
+  write_buf (out, tail, sizeof tail);
+  free (pack_index);
+  pack_index = NULL;
+}
+
+/* Report that the input is not as expected.  */
+static int
+pack_error (char const *msg, char const *name)
+{
+  fprintf (stderr, "%s: %s: %s%s\n", program_name, ifname, msg, name);
+  exit_code = ERROR;
+  return ERROR;
+}
+
+/* ===========================================================================
+ * Find the member of the file NAME in the --pack index of the file IN,
+ * and seek to it.  Return OK or ERROR.
+ */
+int
+pack_seek (int in, char const *name)
+{
+  char end[PACK_END_LEN + PACK_TAIL_LEN + 1];
+  size_t name_len = strlen (name);
+  intmax_t index_offset, len;
+  off_t size = lseek (in, 0, SEEK_END);
+  off_t base;
+  char *buf, *p, *lim;
+  size_t n;
+
+  if (size < 0)
+    return pack_error ("not a regular file -- cannot find members", "");
+  if (size < (off_t) sizeof end - 1
+      || pread (in, end, sizeof end - 1, size - (sizeof end - 1))
+         != sizeof end - 1
+      || memcmp (end + PACK_END_LEN, "\0\003\0\0\0\0\0\0\0\0\0",
+                 PACK_TAIL_LEN) != 0)
+    return pack_error ("no --pack index", "");
+  end[PACK_END_LEN] = '\0';
+  if (sscanf (end, "end %jd %jd\n", &index_offset, &len) != 2
+      || len < 10 + PACK_END_LEN + PACK_TAIL_LEN || size < len
+      || index_offset < 0 || len - PACK_END_LEN - PACK_TAIL_LEN - 10
+                             < index_offset)
+    return pack_error ("no --pack index", "");
+  base = size - len;
+
+  /* Read the header and the comment of the index member.  */
+  n = len - index_offset - PACK_END_LEN - PACK_TAIL_LEN;
+  buf = xmalloc (n + 1);
+  if (pread (in, buf, n, base + index_offset) != (ssize_t) n)
+    {
+      free (buf);
+      read_error ();
+    }
+  buf[n] = '\0';
+  if (memcmp (buf, "\037\213\010\020", 4) != 0
+      || strncmp (buf + 10, PACK_INDEX_MAGIC, sizeof PACK_INDEX_MAGIC - 1) != 0)
+    {
+      free (buf);
+      return pack_error ("no --pack index", "");
+    }
+
+  for (p = buf + 10 + sizeof PACK_INDEX_MAGIC - 1; (lim = strchr (p, '\n'));
+       p = lim + 1)
+    {
+      intmax_t offset, length;
+      int k;
+      if (sscanf (p, "%jd %jd%n", &offset, &length, &k) == 2 && p[k++] == ' '
+          && (size_t) (lim - (p + k)) == name_len
+          && memcmp (p + k, name, name_len) == 0
+          && 0 <= offset && offset < index_offset)
+        {
+          free (buf);
+          if (lseek (in, base + offset, SEEK_SET) < 0)
+            read_error ();
+          return OK;
+        }
+    }
+  free (buf);
+  return pack_error ("no member named ", name);
+}
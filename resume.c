@@ -0,0 +1,238 @@
+/* resume.c -- checkpoints to resume an interrupted compression
+
+   Copyright (C) 2025 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* With --resumable, the input file is compressed in segments of
+ * resume_interval bytes.  Each segment is deflated on its own, with an
+ * empty window, and its last block is followed by an empty stored block
+ * that ends it on a byte boundary, like a zlib full flush.  After each
+ * segment the output file is synced, and a journal FILE.gz.resume
+ * records the input and output offsets of the next segment, with the CRC
+ * so far.  The journal is removed once the output is complete.
+ *
+ * When a run with the same level, --rsyncable and interval finds a
+ * journal for the same input file, the output file is truncated at the
+ * last checkpoint and compression goes on from there.  The result is
+ * the same as that of an uninterrupted run.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "crc.h"
+#include "tailor.h"
+#include "gzip.h"
+
+#ifndef MAX_PATH_LEN
+#  define MAX_PATH_LEN   1024 /* max pathname length */
+#endif
+
+#define JOURNAL_SUFFIX ".resume"
+#define TAIL_LEN 4096       /* output bytes checked before a checkpoint */
+
+off_t resume_interval;      /* --resumable, or 0 */
+off_t resume_next = -1;     /* input offset of the next checkpoint, or -1 */
+bool resuming;              /* the output file is being resumed */
+
+static char journal_name[MAX_PATH_LEN]; /* journal of the current output */
+static int journal_fd = -1; /* open journal, or -1 */
+static struct timespec input_mtime; /* of the current input */
+
+/* The state saved at a checkpoint, and the input it is valid for.  */
+static struct journal {
+  int level;
+  int rsync;
+  intmax_t interval;
+  intmax_t in_size;
+  intmax_t in_mtime;
+  long in_mtime_ns;
+  intmax_t in_off;          /* next segment in the input */
+  intmax_t out_off;         /* and in the output */
+  unsigned long crc;        /* CRC of the input before in_off */
+  intmax_t header_len;      /* length of the gzip header */
+  unsigned long tail_crc;   /* CRC of the output bytes before out_off */
+} saved;
+
+/* Fixed-width fields, so that a checkpoint overwrites the previous one.  */
+static char const journal_format[] =
+  "gzip-resume 1 %d %d %20jd %20jd %20jd %9ld %20jd %20jd %8lx %20jd %8lx\n";
+
+/* Report a problem with the journal, which only prevents resuming.  */
+static void
+journal_warning (char const *msg)
+{
+  WARN ((stderr, "%s: %s: %s\n", program_name, journal_name, msg));
+}
+
+/* ===========================================================================
+ * Return the CRC of the TAIL_LEN bytes (or fewer) before offset END in
+ * the file FD, or -1 if they cannot be read.  This tells whether the
+ * output file is still the one the journal was written for.
+ */
+static long
+tail_crc (int fd, off_t end)
+{
+  char buf[TAIL_LEN];
+  off_t start = end < TAIL_LEN ? 0 : end - TAIL_LEN;
+  ssize_t n = pread (fd, buf, end - start, start);
+
+  return n == end - start ? (long) crc32_update (0, buf, n) : -1;
+}
+
+/* ===========================================================================
+ * Prepare to compress the input file, of size ifile_size and modified
+ * at MTIME, to ofname.  If a journal for that output is valid for this
+ * input and these options, arrange for the output file to be resumed,
+ * and set resuming.
+ */
+void
+resume_load (struct timespec mtime)
+{
+  char buf[256];
+  ssize_t n;
+  int fd;
+
+  resuming = false;
+  resume_next = resume_interval;
+  input_mtime = mtime;
+  if (strlen (ofname) + sizeof JOURNAL_SUFFIX > sizeof journal_name)
+    {
+      /* No journal, and thus no checkpoints.  */
+      journal_name[0] = '\0';
+      resume_next = -1;
+      return;
+    }
+  strcpy (journal_name, ofname);
+  strcat (journal_name, JOURNAL_SUFFIX);
+
+  fd = open (journal_name, O_RDONLY | O_BINARY);
+  if (fd < 0)
+    return;
+  n = read (fd, buf, sizeof buf - 1);
+  close (fd);
+  buf[n < 0 ? 0 : n] = '\0';
+  if (sscanf (buf, journal_format, &saved.level, &saved.rsync,
+              &saved.interval, &saved.in_size, &saved.in_mtime,
+              &saved.in_mtime_ns, &saved.in_off, &saved.out_off, &saved.crc,
+              &saved.header_len, &saved.tail_crc) != 11
+      || saved.level != level || saved.rsync != rsync
+      || saved.interval != resume_interval
+      || saved.in_size != ifile_size || saved.in_mtime != mtime.tv_sec
+      || saved.in_mtime_ns != mtime.tv_nsec
+      || saved.in_off <= 0 || ifile_size < saved.in_off
+      || saved.out_off <= saved.header_len)
+    fd = -1;
+  else
+    fd = open (ofname, O_RDONLY | O_BINARY);
+  if (fd < 0 || tail_crc (fd, saved.out_off) != (long) saved.tail_crc)
+    {
+      journal_warning ("journal does not match -- ignored");
+      if (0 <= fd)
+        close (fd);
+      return;
+    }
+  close (fd);
+  resuming = true;
+  resume_next = saved.in_off + resume_interval;
+}
+
+/* ===========================================================================
+ * Continue the output OUT of the input IN from the last checkpoint.  The
+ * gzip header just put in the output buffer is dropped, as the output
+ * already starts with it.
+ */
+void
+resume_restore (int in, int out)
+{
+  outcnt = 0;
+  if (lseek (in, saved.in_off, SEEK_SET) != saved.in_off)
+    read_error ();
+  if (ftruncate (out, saved.out_off) != 0
+      || lseek (out, saved.out_off, SEEK_SET) != saved.out_off)
+    write_error ();
+  bytes_in = saved.in_off;
+  bytes_out = saved.out_off;
+  header_bytes = saved.header_len;
+  setcrc (saved.crc);
+}
+
+/* ===========================================================================
+ * Record a checkpoint at the current input offset, which is resume_next:
+ * sync the compressed data so far and write the journal.
+ */
+void
+resume_checkpoint ()
+{
+  char buf[256];
+  int len;
+
+  flush_outbuf ();
+  if (fsync (ofd) != 0 && errno != EINVAL)
+    write_error ();
+
+  if (journal_fd < 0)
+    {
+      journal_fd = open (journal_name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+                         S_IRUSR | S_IWUSR);
+      if (journal_fd < 0)
+        {
+          journal_warning (strerror (errno));
+          resume_next = -1;
+          return;
+        }
+      /* From now on, an interrupted output can be resumed.  */
+      keep_output_file ();
+    }
+
+  len = sprintf (buf, journal_format, level, rsync, (intmax_t) resume_interval,
+                 (intmax_t) ifile_size, (intmax_t) input_mtime.tv_sec,
+                 (long) input_mtime.tv_nsec,
+                 (intmax_t) bytes_in, (intmax_t) bytes_out, getcrc (),
+                 (intmax_t) header_bytes,
+                 (unsigned long) tail_crc (ofd, bytes_out));
+  if (pwrite (journal_fd, buf, len, 0) != len || fdatasync (journal_fd) != 0)
+    {
+      journal_warning (strerror (errno));
+      close (journal_fd);
+      journal_fd = -1;
+      resume_next = -1;
+      return;
+    }
+  resume_next += resume_interval;
+}
+
+/* ===========================================================================
+ * Done with the output file.  If it is COMPLETE (and synced), remove its
+ * journal; otherwise keep it to resume later.
+ */
+void
+resume_finish (bool complete)
+{
+  if (0 <= journal_fd)
+    close (journal_fd);
+  journal_fd = -1;
+  if (complete && journal_name[0]
+      && unlink (journal_name) != 0 && errno != ENOENT)
+    journal_warning (strerror (errno));
+  resume_next = -1;
+  resuming = false;
+}
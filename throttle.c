@@ -0,0 +1,212 @@
+/* throttle.c -- run gzip in the background of other work
+
+   Copyright (C) 2025 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* With --background, gzip asks to be scheduled only when the CPU would
+ * otherwise be idle (SCHED_IDLE, or else the highest nice value), and
+ * for the idle I/O class.  In addition, throttle is called with the
+ * number of bytes of each read and write of file data:
+ *
+ * - With --background=RATE, reads and writes together are limited to
+ *   RATE bytes per second by a token bucket, with bursts of at most a
+ *   tenth of a second.
+ *
+ * - Every PSI_PERIOD, the pressure stall information of the CPU and of
+ *   I/O (the share of time some tasks waited for them in the last ten
+ *   seconds) is read from /proc/pressure.  While either is above
+ *   PSI_LIMIT percent, gzip pauses after each period, for twice as long
+ *   each time up to a second; once the pressure is gone, the pause is
+ *   halved each time.  So gzip gets what capacity is left over.
+ *
+ * Child processes inherit the scheduling.  RATE is for gzip as a whole:
+ * while it runs other processes that read or write at the same time
+ * (--pack, --batch, the entries of a .zip file, --tee-levels and
+ * --raw-copy, --pipeline, --verify and --recompress), each of them and
+ * gzip itself get an equal share of it (see throttle_split).
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#  include <sched.h>
+#  include <sys/syscall.h>
+#endif
+
+#include "tailor.h"
+#include "gzip.h"
+#include "ignore-value.h"
+
+#define PSI_PERIOD   100000000  /* ns between pressure checks */
+#define PSI_LIMIT    10         /* percentage of time stalled */
+#define PAUSE_MIN    10000000   /* first pause, in ns */
+#define PAUSE_MAX    1000000000 /* longest pause */
+
+#define IOPRIO_CLASS_IDLE  3    /* from linux/ioprio.h */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+bool background;            /* --background */
+off_t background_rate;      /* its RATE in bytes per second, or 0 */
+
+static intmax_t tokens;     /* bytes that can be read or written now */
+static intmax_t last;       /* time of the last call of throttle */
+static intmax_t next_check; /* time of the next pressure check */
+static intmax_t pause_ns;   /* current pause under pressure, or 0 */
+static int share = 1;       /* background_rate is split in this many */
+
+/* Return the current time in nanoseconds, from an arbitrary origin.  */
+static intmax_t
+now_ns (void)
+{
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) != 0)
+#endif
+    clock_gettime (CLOCK_REALTIME, &ts);
+  return ts.tv_sec * (intmax_t) 1000000000 + ts.tv_nsec;
+}
+
+/* Sleep for NS nanoseconds.  */
+static void
+sleep_ns (intmax_t ns)
+{
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  while (nanosleep (&ts, &ts) != 0 && errno == EINTR)
+    continue;
+}
+
+/* Return the percentage of the last ten seconds during which some tasks
+   stalled for the resource of the pressure file FILE, or 0 if unknown.  */
+static int
+pressure (char const *file)
+{
+  char buf[256];
+  char *p;
+  int avg = 0;
+  int fd = open (file, O_RDONLY);
+  ssize_t n;
+
+  if (fd < 0)
+    return 0;
+  n = read (fd, buf, sizeof buf - 1);
+  close (fd);
+  buf[n < 0 ? 0 : n] = '\0';
+  p = strstr (buf, "some avg10=");
+  if (p)
+    sscanf (p, "some avg10=%d", &avg);
+  return avg;
+}
+
+/* ===========================================================================
+ * Lower the priority of gzip for --background.
+ */
+void
+background_start ()
+{
+#ifdef SCHED_IDLE
+  struct sched_param param;
+  memset (&param, 0, sizeof param);
+  if (sched_setscheduler (0, SCHED_IDLE, &param) != 0)
+#endif
+    ignore_value (nice (19));
+#ifdef SYS_ioprio_set
+  ignore_value (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                         IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT));
+#endif
+
+  last = now_ns ();
+  next_check = last + PSI_PERIOD;
+  tokens = background_rate / 10;
+}
+
+/* ===========================================================================
+ * This process is about to start N - 1 others that read or write at the
+ * same time as it does: from now on, each gets 1/N of its rate.  The
+ * children inherit this, so shares of shares add up to RATE.
+ */
+void
+throttle_split (int n)
+{
+  if (1 < n)
+    share *= n;
+}
+
+/* ===========================================================================
+ * The N - 1 processes of the matching throttle_split are done.
+ */
+void
+throttle_merge (int n)
+{
+  if (1 < n)
+    share /= n;
+}
+
+/* ===========================================================================
+ * N bytes of file data were just read or written: wait as needed.
+ */
+void
+throttle (unsigned n)
+{
+  intmax_t t = now_ns ();
+
+  if (background_rate)
+    {
+      intmax_t rate = background_rate / share ? background_rate / share : 1;
+      intmax_t burst = rate / 10;
+      intmax_t elapsed = t - last;
+      if (elapsed < 1000000000)
+        tokens += elapsed * rate / 1000000000;
+      else
+        tokens = burst;
+      if (burst < tokens)
+        tokens = burst;
+      tokens -= n;
+      if (tokens < 0)
+        {
+          sleep_ns (-tokens * 1000000000 / rate);
+          t = now_ns ();
+          tokens = 0;
+        }
+    }
+
+  if (next_check <= t)
+    {
+      int psi = pressure ("/proc/pressure/cpu");
+      int io = pressure ("/proc/pressure/io");
+      if (psi < io)
+        psi = io;
+      if (PSI_LIMIT < psi)
+        pause_ns = (!pause_ns ? PAUSE_MIN
+                    : pause_ns < PAUSE_MAX / 2 ? 2 * pause_ns : PAUSE_MAX);
+      else
+        pause_ns = pause_ns < 2 * PAUSE_MIN ? 0 : pause_ns / 2;
+      if (pause_ns)
+        {
+          sleep_ns (pause_ns);
+          t = now_ns ();
+        }
+      next_check = t + PSI_PERIOD;
+    }
+  last = t;
+}
@@ -51,9 +51,8 @@
  *  INTERFACE
  *
  *      void ct_init (ush *attr, int *methodp)
- *          Allocate the match buffer, initialize the various tables and save
- *          the location of the internal file attribute (ascii/binary) and
- *          method (DEFLATE/STORE)
+ *          Save the location of the internal file attribute (ascii/binary)
+ *          and method (DEFLATE/STORE), and start a new file
  *
  *      void ct_tally (int dist, int lc);
  *          Save the match info and tally the frequency counts.
@@ -67,6 +66,7 @@
 
 #include <config.h>
 #include <ctype.h>
+#include <unistd.h>
 
 #include "tailor.h"
 #include "gzip.h"
@@ -188,11 +188,17 @@ typedef struct ct_data {
 static ct_data near dyn_ltree[HEAP_SIZE];   /* literal and length tree */
 static ct_data near dyn_dtree[2*D_CODES+1]; /* distance tree */
 
+/* The tables below never change.  They are computed by tr_static_init
+ * when this file is compiled with -DGEN_TREES_H, which also writes them
+ * to trees.h; otherwise they are read from trees.h as constant data, so
+ * that a process compressing a small file need not compute them.
+ */
+#ifdef GEN_TREES_H
 static ct_data near static_ltree[L_CODES+2];
 /* The static literal tree. Since the bit lengths are imposed, there is no
  * need for the L_CODES extra codes used during heap construction. However
- * The codes 286 and 287 are needed to build a canonical tree (see ct_init
- * below).
+ * The codes 286 and 287 are needed to build a canonical tree (see
+ * tr_static_init below).
  */
 
 static ct_data near static_dtree[D_CODES];
@@ -200,27 +206,75 @@ static ct_data near static_dtree[D_CODES];
  * 5 bits.)
  */
 
+static uch length_code[MAX_MATCH-MIN_MATCH+1];
+/* length code for each normalized match length (0 == MIN_MATCH) */
+
+static uch dist_code[512];
+/* distance codes. The first 256 values correspond to the distances
+ * 3 .. 258, the last 256 values correspond to the top 8 bits of
+ * the 15 bit distances.
+ */
+
+static int near base_length[LENGTH_CODES];
+/* First normalized length for each code (0 = MIN_MATCH) */
+
+static int near base_dist[D_CODES];
+/* First normalized distance for each code (0 = distance of 1) */
+
+static ush near log2_frac[256];
+/* log2(1 + i/256), in 1/256 bits */
+#else
+#  include "trees.h"
+#endif
+
 static ct_data near bl_tree[2*BL_CODES+1];
 /* Huffman tree for the bit lengths */
 
+/* The last tree built from each tree descriptor.  Small blocks, as made
+ * with --rsyncable, often have the same frequencies as the block before,
+ * notably for the distance and bit length trees, and then the tree
+ * need not be built again.  If they are only close to them, the last
+ * tree may still be good enough; see reuse_tree.
+ */
+typedef struct tree_memo {
+    int     valid;               /* whether the fields below are set */
+    int     max_code;            /* max_code of the tree */
+    ulg     opt_len;             /* what building the tree added to opt_len */
+    ulg     static_len;          /* and to static_len */
+    ush     freq[L_CODES];       /* the frequencies it was built from */
+    ct_data tree[L_CODES];       /* the resulting codes and lengths */
+} tree_memo;
+
+static tree_memo near l_memo, d_memo, bl_memo;
+
+/* Trees are reused only within a segment, so that the output of a
+ * segment or a file does not depend on what came before it: a resumed
+ * compression must give the same bytes.
+ */
+#define forget_trees() (l_memo.valid = d_memo.valid = bl_memo.valid = 0)
+
 typedef struct tree_desc {
     ct_data near *dyn_tree;      /* the dynamic tree */
-    ct_data near *static_tree;   /* corresponding static tree or NULL */
+    ct_data const near *static_tree; /* corresponding static tree or NULL */
     int     near *extra_bits;    /* extra bits for each code or NULL */
     int     extra_base;          /* base index for extra_bits */
     int     elems;               /* max number of elements in the tree */
     int     max_length;          /* max bit length for the codes */
     int     max_code;            /* largest code with non zero frequency */
+    tree_memo near *memo;        /* the last tree built */
 } tree_desc;
 
 static tree_desc near l_desc =
-{dyn_ltree, static_ltree, extra_lbits, LITERALS+1, L_CODES, MAX_BITS, 0};
+{dyn_ltree, static_ltree, extra_lbits, LITERALS+1, L_CODES, MAX_BITS, 0,
+ &l_memo};
 
 static tree_desc near d_desc =
-{dyn_dtree, static_dtree, extra_dbits, 0,          D_CODES, MAX_BITS, 0};
+{dyn_dtree, static_dtree, extra_dbits, 0,          D_CODES, MAX_BITS, 0,
+ &d_memo};
 
 static tree_desc near bl_desc =
-{bl_tree, (ct_data near *)0, extra_blbits, 0,      BL_CODES, MAX_BL_BITS, 0};
+{bl_tree, (ct_data near *)0, extra_blbits, 0,      BL_CODES, MAX_BL_BITS, 0,
+ &bl_memo};
 
 
 static ush near bl_count[MAX_BITS+1];
@@ -232,30 +286,11 @@ static uch near bl_order[BL_CODES]
  * probability, to avoid transmitting the lengths for unused bit length codes.
  */
 
-static int near heap[2*L_CODES+1]; /* heap used to build the Huffman trees */
-static int heap_len;               /* number of elements in the heap */
-static int heap_max;               /* element of largest frequency */
-/* The sons of heap[n] are heap[2*n] and heap[2*n+1]. heap[0] is not used.
- * The same heap array is used to build all trees.
- */
+static int near sorted[L_CODES];
+/* The codes of nonzero frequency, by increasing frequency */
 
-static uch near depth[2*L_CODES+1];
-/* Depth of each subtree used as tie breaker for trees of equal frequency */
-
-static uch length_code[MAX_MATCH-MIN_MATCH+1];
-/* length code for each normalized match length (0 == MIN_MATCH) */
-
-static uch dist_code[512];
-/* distance codes. The first 256 values correspond to the distances
- * 3 .. 258, the last 256 values correspond to the top 8 bits of
- * the 15 bit distances.
- */
-
-static int near base_length[LENGTH_CODES];
-/* First normalized length for each code (0 = MIN_MATCH) */
-
-static int near base_dist[D_CODES];
-/* First normalized distance for each code (0 = distance of 1) */
+static ulg near weight[L_CODES];
+/* Their frequencies, replaced in place by their bit lengths */
 
 #define l_buf inbuf
 /* DECLARE(uch, l_buf, LIT_BUFSIZE);  buffer for literals or lengths */
@@ -277,6 +312,21 @@ static uch flag_bit;         /* current bit used in flags */
  * take advantage of DIST_BUFSIZE == LIT_BUFSIZE.
  */
 
+static ulg block_in;       /* input bytes in the current block */
+
+/* Block splitting.  Every SPLIT_LITS symbols, the symbols since the
+ * previous such point are compared with the rest of the block.  If
+ * their statistics differ enough that two blocks would be cheaper than
+ * one, the block is ended at the previous point.  split_lit etc. are
+ * the values of last_lit etc. at that point, or 0 if there is none in
+ * the current block.
+ */
+#define SPLIT_LITS 0x1000
+static unsigned split_lit, split_dist, split_flags;
+static ulg split_in;
+static ush near split_lfreq[L_CODES];
+static ush near split_dfreq[D_CODES];
+
 static ulg opt_len;        /* bit length of current block with optimal trees */
 static ulg static_len;     /* bit length of current block with static trees */
 
@@ -299,17 +349,28 @@ extern unsigned near strstart; /* window offset of current string */
  * Local (static) routines in this file.
  */
 
+#ifdef GEN_TREES_H
+static void tr_static_init (void);
+static void gen_trees_header (void);
+#endif
 static void init_block (void);
-static void pqdownheap (ct_data near *tree, int k);
-static void gen_bitlen (tree_desc near *desc);
+static int  split_block (void);
+static ulg  log2_fix (ulg x);
+static int  reuse_tree (tree_desc near *desc);
+static void sort_codes (ct_data near *tree, int count);
+static void gen_bitlen (int count);
+static void limit_bitlen (tree_desc near *desc, int count);
 static void gen_codes (ct_data near *tree, int max_code);
 static void build_tree (tree_desc near *desc);
 static void scan_tree (ct_data near *tree, int max_code);
 static void send_tree (ct_data near *tree, int max_code);
 static int  build_bl_tree  (void);
 static void send_all_trees (int lcodes, int dcodes, int blcodes);
-static void compress_block (ct_data near *ltree, ct_data near *dtree);
+static void compress_block (ct_data const near *ltree,
+                            ct_data const near *dtree);
 static void set_file_type (void);
+static off_t code_block (char *buf, ulg stored_len, int pad, int eof,
+                         int checkpoint);
 
 
 #ifndef DEBUG
@@ -333,14 +394,31 @@ static void set_file_type (void);
 /* the arguments must not have side effects */
 
 /* ===========================================================================
- * Allocate the match buffer, initialize the various tables and save the
- * location of the internal file attribute (ascii/binary) and method
- * (DEFLATE/STORE).
+ * Save the location of the internal file attribute (ascii/binary) and
+ * method (DEFLATE/STORE), and start the first block of a new file.
  * ATTR points to internal file attribute.
  * METHODP points to the compression method.
  */
 void
 ct_init (ush *attr, int *methodp)
+{
+    file_type = attr;
+    file_method = methodp;
+    compressed_len = input_len = 0L;
+    forget_trees ();
+
+#ifdef GEN_TREES_H
+    if (static_dtree[0].Len == 0) tr_static_init ();
+#endif
+    init_block();
+}
+
+#ifdef GEN_TREES_H
+/* ===========================================================================
+ * Compute the constant tables, and write them to trees.h.
+ */
+static void
+tr_static_init ()
 {
     int n;        /* iterates over tree elements */
     int bits;     /* bit counter */
@@ -348,11 +426,17 @@ ct_init (ush *attr, int *methodp)
     int code;     /* code value */
     int dist;     /* distance index */
 
-    file_type = attr;
-    file_method = methodp;
-    compressed_len = input_len = 0L;
-
-    if (static_dtree[0].Len != 0) return; /* ct_init already called */
+    /* Initialize the table for block_cost.  */
+    for (n = 0; n < 256; n++) {
+        double y = 1 + n / 256.0;
+        int f = 0;
+        for (bits = 0; bits < 8; bits++) {
+            y *= y;
+            f <<= 1;
+            if (y >= 2) y /= 2, f |= 1;
+        }
+        log2_frac[n] = (ush)f;
+    }
 
     /* Initialize the mapping length (0..255) -> length code (0..28) */
     length = 0;
@@ -362,7 +446,7 @@ ct_init (ush *attr, int *methodp)
             length_code[length++] = (uch)code;
         }
     }
-    Assert (length == 256, "ct_init: length != 256");
+    Assert (length == 256, "tr_static_init: length != 256");
     /* Note that the length 255 (match length 258) can be represented
      * in two different ways: code 284 + 5 bits or code 285, so we
      * overwrite length_code[255] to use the best encoding:
@@ -377,7 +461,7 @@ ct_init (ush *attr, int *methodp)
             dist_code[dist++] = (uch)code;
         }
     }
-    Assert (dist == 256, "ct_init: dist != 256");
+    Assert (dist == 256, "tr_static_init: dist != 256");
     dist >>= 7; /* from now on, all distances are divided by 128 */
     for ( ; code < D_CODES; code++) {
         base_dist[code] = dist << 7;
@@ -385,7 +469,7 @@ ct_init (ush *attr, int *methodp)
             dist_code[256 + dist++] = (uch)code;
         }
     }
-    Assert (dist == 256, "ct_init: 256+dist != 512");
+    Assert (dist == 256, "tr_static_init: 256+dist != 512");
 
     /* Construct the codes of the static literal tree */
     for (bits = 0; bits <= MAX_BITS; bits++) bl_count[bits] = 0;
@@ -406,10 +490,70 @@ ct_init (ush *attr, int *methodp)
         static_dtree[n].Code = bi_reverse(n, 5);
     }
 
-    /* Initialize the first block of the first file: */
-    init_block();
+    gen_trees_header ();
+}
+
+/* ===========================================================================
+ * Write the N elements VALUES of the table NAME of type DECL to FP, each
+ * in WIDTH columns.
+ */
+static void
+gen_table (FILE *fp, char const *decl, char const *name, int const *values,
+           int n, int width)
+{
+    int per_line = 78 / (width + 2);
+    int i;
+    fprintf (fp, "\nstatic %s const near %s[%d] = {", decl, name, n);
+    for (i = 0; i < n; i++)
+        fprintf (fp, "%s%*d%s", i % per_line ? " " : "\n", width, values[i],
+                 i + 1 < n ? "," : "");
+    fprintf (fp, "\n};\n");
+}
+
+/* ===========================================================================
+ * Write a static tree of N elements, TREE, as the table NAME to FP.
+ */
+static void
+gen_tree (FILE *fp, char const *name, ct_data const near *tree, int n)
+{
+    int i;
+    fprintf (fp, "\nstatic ct_data const near %s[%d] = {", name, n);
+    for (i = 0; i < n; i++)
+        fprintf (fp, "%s{{%3u},{%u}}%s", i % 6 ? " " : "\n",
+                 tree[i].Code, tree[i].Len, i + 1 < n ? "," : "");
+    fprintf (fp, "\n};\n");
 }
 
+/* ===========================================================================
+ * Write the constant tables to trees.h.
+ */
+static void
+gen_trees_header ()
+{
+    FILE *fp = fopen ("trees.h", "w");
+    int v[512];
+    int i;
+
+    if (!fp)
+        gzip_error ("cannot write trees.h");
+    fprintf (fp, "/* trees.h -- constant tables for trees.c\n"
+             "   Generated by trees.c compiled with -DGEN_TREES_H; "
+             "do not edit.  */\n");
+    gen_tree (fp, "static_ltree", static_ltree, L_CODES+2);
+    gen_tree (fp, "static_dtree", static_dtree, D_CODES);
+    for (i = 0; i < MAX_MATCH-MIN_MATCH+1; i++) v[i] = length_code[i];
+    gen_table (fp, "uch", "length_code", v, MAX_MATCH-MIN_MATCH+1, 2);
+    for (i = 0; i < 512; i++) v[i] = dist_code[i];
+    gen_table (fp, "uch", "dist_code", v, 512, 2);
+    gen_table (fp, "int", "base_length", base_length, LENGTH_CODES, 3);
+    gen_table (fp, "int", "base_dist", base_dist, D_CODES, 5);
+    for (i = 0; i < 256; i++) v[i] = log2_frac[i];
+    gen_table (fp, "ush", "log2_frac", v, 256, 3);
+    if (fclose (fp) != 0)
+        gzip_error ("cannot write trees.h");
+}
+#endif /* GEN_TREES_H */
+
 /* ===========================================================================
  * Initialize a new block.
  */
@@ -427,144 +571,154 @@ init_block ()
     opt_len = static_len = 0L;
     last_lit = last_dist = last_flags = 0;
     flags = 0; flag_bit = 1;
+    block_in = 0;
+    split_lit = 0;
 }
 
-#define SMALLEST 1
-/* Index within the heap array of least frequent node in the Huffman tree */
-
-
 /* ===========================================================================
- * Remove the smallest element from the heap and recreate the heap with
- * one less element. Updates heap and heap_len.
+ * Sort the COUNT codes in sorted[] by increasing frequency, keeping codes
+ * of equal frequency in increasing order, and set weight[] to their
+ * frequencies.  This is a counting sort on each byte of the frequency,
+ * low byte first; the high byte is skipped if all frequencies are small.
  */
-#define pqremove(tree, top) \
-{\
-    top = heap[SMALLEST]; \
-    heap[SMALLEST] = heap[heap_len--]; \
-    pqdownheap(tree, SMALLEST); \
+static void
+sort_codes (ct_data near *tree, int count)
+{
+    int near tmp[L_CODES];
+    unsigned near start[256];
+    unsigned high = 0;   /* all frequencies or'ed together */
+    int shift, i;
+
+    for (i = 0; i < count; i++)
+        high |= tree[sorted[i]].Freq;
+    for (shift = 0; shift < (high >> 8 ? 16 : 8); shift += 8) {
+        unsigned sum = 0;
+        memset (start, 0, sizeof start);
+        for (i = 0; i < count; i++)
+            start[(tree[sorted[i]].Freq >> shift) & 0xff]++;
+        for (i = 0; i < 256; i++) {
+            unsigned c = start[i];
+            start[i] = sum;
+            sum += c;
+        }
+        for (i = 0; i < count; i++)
+            tmp[start[(tree[sorted[i]].Freq >> shift) & 0xff]++] = sorted[i];
+        memcpy (sorted, tmp, count * sizeof *sorted);
+    }
+    for (i = 0; i < count; i++)
+        weight[i] = tree[sorted[i]].Freq;
 }
 
 /* ===========================================================================
- * Compares to subtrees, using the tree depth as tie breaker when
- * the subtrees have equal frequency. This minimizes the worst case length.
- */
-#define smaller(tree, n, m) \
-   (tree[n].Freq < tree[m].Freq || \
-   (tree[n].Freq == tree[m].Freq && depth[n] <= depth[m]))
-
-/* ===========================================================================
- * Restore the heap property by moving down the tree starting at node k,
- * exchanging a node with the smallest of its two sons if necessary, stopping
- * when the heap property is re-established (each father smaller than its
- * two sons).
- * TREE is the tree to restore.
- * K is the node to move down.
+ * Replace the COUNT sorted frequencies in weight[] by the optimal bit
+ * lengths of their codes, which may exceed MAX_BITS.  This is the
+ * in-place algorithm of Moffat and Katajainen: the first pass builds the
+ * tree in the array, leaving in each internal node the index of its
+ * parent, the second turns these into depths, and the third counts the
+ * leaves at each depth.  No heap is needed since the frequencies are
+ * sorted.  Ties between a leaf and an internal node go to the leaf, which
+ * keeps the tree shallow.
+ * IN assertion: count >= 2.
  */
 static void
-pqdownheap (ct_data near *tree, int k)
+gen_bitlen (int count)
 {
-    int v = heap[k];
-    int j = k << 1;  /* left son of k */
-    while (j <= heap_len) {
-        /* Set j to the smallest of the two sons: */
-        if (j < heap_len && smaller(tree, heap[j+1], heap[j])) j++;
+    int root, leaf, next;   /* first internal node, leaf, and node made */
+    int avail, used, depth;
 
-        /* Exit if v is smaller than both sons */
-        if (smaller(tree, v, heap[j])) break;
+    /* Combine the two smallest of the remaining leaves and internal
+     * nodes, which are both in increasing order of frequency.
+     */
+    weight[0] += weight[1];
+    root = 0, leaf = 2;
+    for (next = 1; next < count - 1; next++) {
+        if (leaf >= count || weight[root] < weight[leaf]) {
+            weight[next] = weight[root];
+            weight[root++] = next;
+        } else {
+            weight[next] = weight[leaf++];
+        }
+        if (leaf >= count || (root < next && weight[root] < weight[leaf])) {
+            weight[next] += weight[root];
+            weight[root++] = next;
+        } else {
+            weight[next] += weight[leaf++];
+        }
+    }
 
-        /* Exchange v with the smallest son */
-        heap[k] = heap[j];  k = j;
+    /* Depths of the internal nodes, from the root down. */
+    weight[count - 2] = 0;
+    for (next = count - 3; next >= 0; next--)
+        weight[next] = weight[weight[next]] + 1;
 
-        /* And continue down the tree, setting j to the left son of k */
-        j <<= 1;
+    /* Depths of the leaves: each level has twice as many nodes as the
+     * internal nodes above it, and those not internal are leaves,
+     * given to the codes of largest frequency first.
+     */
+    avail = 1, used = 0, depth = 0;
+    root = count - 2, next = count - 1;
+    while (avail > 0) {
+        while (root >= 0 && weight[root] == (ulg)depth) used++, root--;
+        while (avail > used) weight[next--] = depth, avail--;
+        avail = 2 * used;
+        depth++;
+        used = 0;
     }
-    heap[k] = v;
 }
 
 /* ===========================================================================
- * Compute the optimal bit lengths for a tree and update the total bit length
- * for the current block.
- * IN assertion: the fields freq and dad are set, heap[heap_max] and
- *    above are the tree nodes sorted by increasing frequency.
- * OUT assertions: the field len is set to the optimal bit length, the
- *     array bl_count contains the frequencies for each bit length.
- *     The length opt_len is updated; static_len is also updated if stree is
- *     not null.
+ * Limit the bit lengths in weight[] to the maximum of the tree, set the
+ * lengths of the COUNT codes in sorted[], and update the total bit
+ * length for the current block.  Lengths that are too large are cut
+ * down, and shorter codes lengthened until the code is complete again;
+ * this happens for example on obj2 and pic of the Calgary corpus.
+ * OUT assertions: the array bl_count contains the frequencies for each
+ *     bit length.  The length opt_len is updated; static_len is also
+ *     updated if stree is not null.
  * DESC is the tree descriptor.
  */
 static void
-gen_bitlen (tree_desc near *desc)
+limit_bitlen (tree_desc near *desc, int count)
 {
     ct_data near *tree  = desc->dyn_tree;
     int near *extra     = desc->extra_bits;
     int base            = desc->extra_base;
-    int max_code        = desc->max_code;
     int max_length      = desc->max_length;
-    ct_data near *stree = desc->static_tree;
-    int h;              /* heap index */
-    int n, m;           /* iterate over the tree elements */
-    int bits;           /* bit length */
-    int xbits;          /* extra bits */
-    ush f;              /* frequency */
-    int overflow = 0;   /* number of elements with bit length too large */
+    ct_data const near *stree = desc->static_tree;
+    ulg total = 0;      /* Kraft sum, in units of 2**-max_length */
+    int bits, i, n;
 
     for (bits = 0; bits <= MAX_BITS; bits++) bl_count[bits] = 0;
-
-    /* In a first pass, compute the optimal bit lengths (which may
-     * overflow in the case of the bit length tree).
-     */
-    tree[heap[heap_max]].Len = 0; /* root of the heap */
-
-    for (h = heap_max+1; h < HEAP_SIZE; h++) {
-        n = heap[h];
-        bits = tree[tree[n].Dad].Len + 1;
-        if (bits > max_length) bits = max_length, overflow++;
-        tree[n].Len = (ush)bits;
-        /* We overwrite tree[n].Dad which is no longer needed */
-
-        if (n > max_code) continue; /* not a leaf node */
-
+    for (i = 0; i < count; i++) {
+        bits = weight[i] < (ulg)max_length ? weight[i] : max_length;
         bl_count[bits]++;
-        xbits = 0;
-        if (n >= base) xbits = extra[n-base];
-        f = tree[n].Freq;
-        opt_len += (ulg)f * (bits + xbits);
-        if (stree) static_len += (ulg)f * (stree[n].Len + xbits);
+        total += 1L << (max_length - bits);
     }
-    if (overflow == 0) return;
 
-    Trace((stderr,"\nbit length overflow\n"));
-    /* This happens for example on obj2 and pic of the Calgary corpus */
-
-    /* Find the first bit length which could increase: */
-    do {
-        bits = max_length-1;
-        while (bl_count[bits] == 0) bits--;
-        bl_count[bits]--;      /* move one leaf down the tree */
-        bl_count[bits+1] += 2; /* move one overflow item as its brother */
-        bl_count[max_length]--;
-        /* The brother of the overflow item also moves one step up,
-         * but this does not affect bl_count[max_length]
+    if (total > 1L << max_length) {
+        Trace((stderr,"\nbit length overflow\n"));
+    }
+    while (total > 1L << max_length) {
+        /* Move one code of the longest length down as the brother of
+         * a code one level up, which gets one bit longer.
          */
-        overflow -= 2;
-    } while (overflow > 0);
+        bl_count[max_length]--;
+        for (bits = max_length - 1; bl_count[bits] == 0; bits--)
+            ;
+        bl_count[bits]--;
+        bl_count[bits+1] += 2;
+        total--;
+    }
 
-    /* Now recompute all bit lengths, scanning in increasing frequency.
-     * h is still equal to HEAP_SIZE. (It is simpler to reconstruct all
-     * lengths instead of fixing only the wrong ones. This idea is taken
-     * from 'ar' written by Haruhiko Okumura.)
-     */
-    for (bits = max_length; bits != 0; bits--) {
-        n = bl_count[bits];
-        while (n != 0) {
-            m = heap[--h];
-            if (m > max_code) continue;
-            if (tree[m].Len != (unsigned) bits) {
-                Trace((stderr,"code %d bits %d->%d\n", m, tree[m].Len, bits));
-                opt_len += ((long)bits-(long)tree[m].Len)*(long)tree[m].Freq;
-                tree[m].Len = (ush)bits;
-            }
-            n--;
+    /* Give the longest codes to the least frequent. */
+    for (i = 0, bits = max_length; bits != 0; bits--) {
+        for (n = bl_count[bits]; n != 0; n--) {
+            int m = sorted[i++];
+            int xbits = m >= base ? extra[m-base] : 0;
+            ush f = tree[m].Freq;
+            tree[m].Len = (ush)bits;
+            opt_len += (ulg)f * (bits + xbits);
+            if (stree) static_len += (ulg)f * (stree[m].Len + xbits);
         }
     }
 }
@@ -611,6 +765,54 @@ gen_codes (ct_data near *tree, int max_code)
     }
 }
 
+/* ===========================================================================
+ * If the last tree built from DESC codes the current frequencies nearly
+ * as well as a new one would, use it again and return 1.  The entropy of
+ * the frequencies is a lower bound of the cost with an optimal code, so
+ * the loss is at most the margin allowed above it.  Otherwise return 0.
+ */
+static int
+reuse_tree (tree_desc near *desc)
+{
+    ct_data near *tree   = desc->dyn_tree;
+    ct_data const near *stree = desc->static_tree;
+    int near *extra      = desc->extra_bits;
+    int base             = desc->extra_base;
+    tree_memo near *memo = desc->memo;
+    ulg total = 0, cost = 0, entropy = 0;
+    ulg bits = 0, sbits = 0; /* additions to opt_len and static_len */
+    int n;
+
+    if (!memo->valid)
+        return 0;
+    for (n = 0; n < desc->elems; n++) {
+        ulg f = tree[n].Freq;
+        int xbits;
+        if (f == 0)
+            continue;
+        if (memo->max_code < n || memo->tree[n].Len == 0)
+            return 0;
+        xbits = n >= base ? extra[n-base] : 0;
+        total += f;
+        cost += f * memo->tree[n].Len;
+        entropy -= f * log2_fix (f);
+        bits += f * (memo->tree[n].Len + xbits);
+        if (stree) sbits += f * (stree[n].Len + xbits);
+    }
+    if (total)
+        entropy += total * log2_fix (total);
+
+    /* Allow 1/128 of the entropy and 8 bits. */
+    if (entropy + (entropy >> 7) + (8 << 8) < cost << 8)
+        return 0;
+
+    memcpy (tree, memo->tree, desc->elems * sizeof *tree);
+    desc->max_code = memo->max_code;
+    opt_len += bits;
+    static_len += sbits;
+    return 1;
+}
+
 /* ===========================================================================
  * Construct one Huffman tree and assigns the code bit strings and lengths.
  * Update the total bit length for the current block.
@@ -624,22 +826,35 @@ static void
 build_tree(tree_desc near *desc)
 {
     ct_data near *tree   = desc->dyn_tree;
-    ct_data near *stree  = desc->static_tree;
+    ct_data const near *stree = desc->static_tree;
     int elems            = desc->elems;
-    int n, m;          /* iterate over heap elements */
+    tree_memo near *memo = desc->memo;
+    ulg old_opt_len      = opt_len;
+    ulg old_static_len   = static_len;
+    int n;
+    int count = 0;     /* number of codes of non zero frequency */
     int max_code = -1; /* largest code with non zero frequency */
-    int node = elems;  /* next internal node of the tree */
 
-    /* Construct the initial heap, with least frequent element in
-     * heap[SMALLEST]. The sons of heap[n] are heap[2*n] and heap[2*n+1].
-     * heap[0] is not used.
+    /* Reuse the last tree if the frequencies are the same, or if it is
+     * almost as good for them.
      */
-    heap_len = 0, heap_max = HEAP_SIZE;
+    for (n = 0; n < elems && tree[n].Freq == memo->freq[n]; n++)
+        ;
+    if (memo->valid && n == elems) {
+        memcpy (tree, memo->tree, elems * sizeof *tree);
+        desc->max_code = memo->max_code;
+        opt_len += memo->opt_len;
+        static_len += memo->static_len;
+        return;
+    }
+    if (reuse_tree (desc))
+        return;
+    for (; n < elems; n++)
+        memo->freq[n] = tree[n].Freq;
 
     for (n = 0; n < elems; n++) {
         if (tree[n].Freq != 0) {
-            heap[++heap_len] = max_code = n;
-            depth[n] = 0;
+            sorted[count++] = max_code = n;
         } else {
             tree[n].Len = 0;
         }
@@ -650,55 +865,26 @@ build_tree(tree_desc near *desc)
      * possible code. So to avoid special checks later on we force at least
      * two codes of non zero frequency.
      */
-    while (heap_len < 2) {
-        int new = heap[++heap_len] = (max_code < 2 ? ++max_code : 0);
+    while (count < 2) {
+        int new = sorted[count++] = (max_code < 2 ? ++max_code : 0);
         tree[new].Freq = 1;
-        depth[new] = 0;
         opt_len--; if (stree) static_len -= stree[new].Len;
         /* new is 0 or 1 so it does not have extra bits */
     }
     desc->max_code = max_code;
 
-    /* The elements heap[heap_len/2+1 .. heap_len] are leaves of the tree,
-     * establish sub-heaps of increasing lengths:
-     */
-    for (n = heap_len/2; n >= 1; n--) pqdownheap(tree, n);
-
-    /* Construct the Huffman tree by repeatedly combining the least two
-     * frequent nodes.
-     */
-    do {
-        pqremove(tree, n);   /* n = node of least frequency */
-        m = heap[SMALLEST];  /* m = node of next least frequency */
-
-        heap[--heap_max] = n; /* keep the nodes sorted by frequency */
-        heap[--heap_max] = m;
-
-        /* Create a new node father of n and m */
-        tree[node].Freq = tree[n].Freq + tree[m].Freq;
-        depth[node] = (uch) (MAX(depth[n], depth[m]) + 1);
-        tree[n].Dad = tree[m].Dad = (ush)node;
-#ifdef DUMP_BL_TREE
-        if (tree == bl_tree) {
-            fprintf(stderr,"\nnode %d(%d), sons %d(%d) %d(%d)",
-                    node, tree[node].Freq, n, tree[n].Freq, m, tree[m].Freq);
-        }
-#endif
-        /* and insert the new node in the heap */
-        heap[SMALLEST] = node++;
-        pqdownheap(tree, SMALLEST);
-
-    } while (heap_len >= 2);
-
-    heap[--heap_max] = heap[SMALLEST];
-
-    /* At this point, the fields freq and dad are set. We can now
-     * generate the bit lengths.
-     */
-    gen_bitlen((tree_desc near *)desc);
+    sort_codes (tree, count);
+    gen_bitlen (count);
+    limit_bitlen (desc, count);
 
     /* The field len is now set, we can generate the bit codes */
     gen_codes ((ct_data near *)tree, max_code);
+
+    memcpy (memo->tree, tree, elems * sizeof *tree);
+    memo->max_code = max_code;
+    memo->opt_len = opt_len - old_opt_len;
+    memo->static_len = static_len - old_static_len;
+    memo->valid = 1;
 }
 
 /* ===========================================================================
@@ -868,13 +1054,18 @@ send_all_trees (int lcodes, int dcodes, int blcodes)
  * STORED_LEN is BUF's length.
  * PAD means pad output to byte boundary.
  * EOF means this is the last block for a file.
+ * CHECKPOINT means that the input ends only for now, at a checkpoint of
+ * --resumable or an access point: then the block ends on a byte boundary
+ * with an empty stored block instead of ending the stream.
  */
-off_t
-flush_block (char *buf, ulg stored_len, int pad, int eof)
+static off_t
+code_block (char *buf, ulg stored_len, int pad, int eof, int checkpoint)
 {
     ulg opt_lenb, static_lenb; /* opt_len and static_len in bytes */
     int max_blindex;  /* index of last bit length code of non zero freq */
 
+    if (checkpoint) eof = 0;
+
     flag_buf[last_flags] = flags; /* Save the flags for the last 8 items */
 
      /* Check if the file is ascii or binary */
@@ -947,7 +1138,7 @@ flush_block (char *buf, ulg stored_len, int pad, int eof)
     } else if (static_lenb == opt_lenb) {
 #endif
         send_bits((STATIC_TREES<<1)+eof, 3);
-        compress_block((ct_data near *)static_ltree, (ct_data near *)static_dtree);
+        compress_block(static_ltree, static_dtree);
         compressed_len += 3 + static_len;
     } else {
         send_bits((DYN_TREES<<1)+eof, 3);
@@ -957,12 +1148,14 @@ flush_block (char *buf, ulg stored_len, int pad, int eof)
     }
     Assert (compressed_len == bits_sent, "bad compressed size");
     init_block();
+    if (checkpoint)
+        forget_trees ();
 
     if (eof) {
         Assert (input_len == bytes_in, "bad input size");
         bi_windup();
         compressed_len += 7;  /* align on byte boundary */
-    } else if (pad && (compressed_len % 8) != 0) {
+    } else if (checkpoint || (pad && (compressed_len % 8) != 0)) {
         send_bits((STORED_BLOCK<<1)+eof, 3);  /* send block type */
         compressed_len = (compressed_len + 3 + 7) & ~7L;
         copy_block(buf, 0, 1); /* with header */
@@ -971,6 +1164,176 @@ flush_block (char *buf, ulg stored_len, int pad, int eof)
     return compressed_len >> 3;
 }
 
+/* ===========================================================================
+ * With --pipeline, the blocks are coded by a child process, concurrently
+ * with the search for matches in the next block: flush_block sends the
+ * symbols and frequencies of each block through the pipe coder_fd, and
+ * the child codes it with code_block as it would have been coded here,
+ * and writes the output.  So the output is the same.  At the end of the
+ * input, or of a segment, the child flushes its output and sends back
+ * bytes_out and compressed_len through the pipe coder_reply.
+ */
+int coder_fd = -1;          /* pipe to the coding process, or -1 */
+int coder_reply = -1;       /* pipe from it */
+
+/* What the coding process needs to know of a block, besides its data.  */
+struct block_info {
+    ulg stored_len;
+    int pad, eof, checkpoint;
+    int has_buf;            /* the input bytes of the block follow */
+    unsigned last_lit, last_dist, last_flags;
+    off_t bytes_in;         /* input read so far, for debugging */
+};
+
+/* What it sends back at the end of the input.  */
+struct coder_result {
+    off_t bytes_out;
+    off_t compressed_len;
+};
+
+/* ===========================================================================
+ * Write the N bytes at BUF to FD, a pipe between the processes of
+ * --pipeline.
+ */
+void
+coder_write (int fd, void const *buf, size_t n)
+{
+    while (n) {
+        ssize_t w = write (fd, buf, n);
+        if (w < 0) write_error ();
+        buf = (char const *) buf + w;
+        n -= w;
+    }
+}
+
+/* ===========================================================================
+ * Read N bytes from FD to BUF.  Return false at end of file.
+ */
+bool
+coder_read (int fd, void *buf, size_t n)
+{
+    while (n) {
+        ssize_t r = read_buffer (fd, buf, n);
+        if (r <= 0) {
+            if (r < 0) read_error ();
+            return false;
+        }
+        buf = (char *) buf + r;
+        n -= r;
+    }
+    return true;
+}
+
+/* Return the length in bytes of the current block with the static
+ * trees, as computed by build_tree.  A stored block is chosen only if
+ * it is no longer than that.
+ */
+static ulg
+static_lenb (void)
+{
+    ulg len = 0;
+    int n;
+    for (n = 0; n < L_CODES; n++)
+        len += (ulg)dyn_ltree[n].Freq
+               * (static_ltree[n].Len
+                  + (n > LITERALS ? extra_lbits[n - LITERALS - 1] : 0));
+    for (n = 0; n < D_CODES; n++)
+        len += (ulg)dyn_dtree[n].Freq * (static_dtree[n].Len + extra_dbits[n]);
+    return (len + 3 + 7) >> 3;
+}
+
+/* ===========================================================================
+ * Flush the current block, with the arguments of code_block (except
+ * CHECKPOINT, computed here).  Return the total compressed length for
+ * the file so far, or with --pipeline, 0 unless EOF.
+ */
+off_t
+flush_block (char *buf, ulg stored_len, int pad, int eof)
+{
+    int checkpoint = eof && bytes_in == resume_next;
+    struct block_info info;
+    struct coder_result res;
+    ush freq[L_CODES + D_CODES];
+    int n;
+
+    if (coder_fd < 0)
+        return code_block (buf, stored_len, pad, eof, checkpoint);
+
+    flag_buf[last_flags] = flags; /* Save the flags for the last 8 items */
+    memset (&info, 0, sizeof info);
+    info.stored_len = stored_len;
+    info.pad = pad;
+    info.eof = eof;
+    info.checkpoint = checkpoint;
+    info.has_buf = buf && (stored_len + 4 <= static_lenb () || seekable ());
+    info.last_lit = last_lit;
+    info.last_dist = last_dist;
+    info.last_flags = last_flags;
+    info.bytes_in = bytes_in;
+    for (n = 0; n < L_CODES; n++) freq[n] = dyn_ltree[n].Freq;
+    for (n = 0; n < D_CODES; n++) freq[L_CODES + n] = dyn_dtree[n].Freq;
+
+    coder_write (coder_fd, &info, sizeof info);
+    coder_write (coder_fd, freq, sizeof freq);
+    coder_write (coder_fd, flag_buf, last_flags + 1);
+    coder_write (coder_fd, l_buf, last_lit);
+    coder_write (coder_fd, d_buf, last_dist * sizeof *d_buf);
+    if (info.has_buf)
+        coder_write (coder_fd, buf, stored_len);
+    init_block();
+
+    if (!eof)
+        return 0;
+    if (!coder_read (coder_reply, &res, sizeof res))
+        gzip_error ("coding process failed");
+    bytes_out = res.bytes_out;
+    return res.compressed_len >> 3;
+}
+
+/* ===========================================================================
+ * In the coding process of --pipeline, code the blocks read from IN and
+ * send the results to OUT, until the end of IN.
+ */
+void
+ct_code_blocks (int in, int out)
+{
+    struct block_info info;
+    ush freq[L_CODES + D_CODES];
+    int n;
+
+    while (coder_read (in, &info, sizeof info)) {
+        if (! (coder_read (in, freq, sizeof freq)
+               && info.last_flags < sizeof flag_buf
+               && coder_read (in, flag_buf, info.last_flags + 1)
+               && info.last_lit < LIT_BUFSIZE
+               && coder_read (in, l_buf, info.last_lit)
+               && info.last_dist <= DIST_BUFSIZE
+               && coder_read (in, d_buf, info.last_dist * sizeof *d_buf)
+               && (!info.has_buf
+                   || (info.stored_len <= 2L*WSIZE
+                       && coder_read (in, window, info.stored_len)))))
+            gzip_error ("bad block from the matching process");
+        for (n = 0; n < L_CODES; n++) dyn_ltree[n].Freq = freq[n];
+        for (n = 0; n < D_CODES; n++) dyn_dtree[n].Freq = freq[L_CODES + n];
+        last_lit = info.last_lit;
+        last_dist = info.last_dist;
+        last_flags = info.last_flags;
+        flags = flag_buf[last_flags];
+        bytes_in = info.bytes_in;
+
+        code_block (info.has_buf ? (char *) window : NULL, info.stored_len,
+                    info.pad, info.eof, info.checkpoint);
+
+        if (info.eof) {
+            struct coder_result res;
+            flush_outbuf ();
+            res.bytes_out = bytes_out;
+            res.compressed_len = compressed_len;
+            coder_write (out, &res, sizeof res);
+        }
+    }
+}
+
 /* ===========================================================================
  * Save the match info and tally the frequency counts. Return true if
  * the current block must be flushed.
@@ -984,6 +1347,7 @@ ct_tally (int dist, int lc)
     if (dist == 0) {
         /* lc is the unmatched char */
         dyn_ltree[lc].Freq++;
+        block_in++;
     } else {
         /* Here, lc is the match length - MIN_MATCH */
         dist--;             /* dist = match distance - 1 */
@@ -996,6 +1360,7 @@ ct_tally (int dist, int lc)
 
         d_buf[last_dist++] = (ush)dist;
         flags |= flag_bit;
+        block_in += lc + MIN_MATCH;
     }
     flag_bit <<= 1;
 
@@ -1004,20 +1369,20 @@ ct_tally (int dist, int lc)
         flag_buf[last_flags++] = flags;
         flags = 0, flag_bit = 1;
     }
-    /* Try to guess if it is profitable to stop the current block here */
-    if (level > 2 && (last_lit & 0xfff) == 0) {
-        /* Compute an upper bound for the compressed length */
-        ulg out_length = (ulg)last_lit*8L;
-        ulg in_length = (ulg)strstart-block_start;
-        int dcode;
-        for (dcode = 0; dcode < D_CODES; dcode++) {
-            out_length += (ulg)dyn_dtree[dcode].Freq*(5L+extra_dbits[dcode]);
+    /* Try to guess if it is profitable to end the block before the last
+     * SPLIT_LITS symbols, and remember this point for the next guess.
+     */
+    if (level > 2 && (last_lit & (SPLIT_LITS-1)) == 0) {
+        int n;
+        if (split_lit != 0 && split_block ()) {
+            Trace((stderr,"\nsplit block, carry %u lits", last_lit));
         }
-        out_length >>= 3;
-        Trace((stderr,"\nlast_lit %u, last_dist %u, in %lu, out ~%lu(%lu%%) ",
-               last_lit, last_dist, in_length, out_length,
-               100L - out_length*100L/in_length));
-        if (last_dist < last_lit/2 && out_length < in_length/2) return 1;
+        split_lit = last_lit;
+        split_dist = last_dist;
+        split_flags = last_flags;
+        split_in = block_in;
+        for (n = 0; n < L_CODES; n++) split_lfreq[n] = dyn_ltree[n].Freq;
+        for (n = 0; n < D_CODES; n++) split_dfreq[n] = dyn_dtree[n].Freq;
     }
     return (last_lit == LIT_BUFSIZE-1 || last_dist == DIST_BUFSIZE);
     /* We avoid equality with LIT_BUFSIZE because of wraparound at 64K
@@ -1026,12 +1391,105 @@ ct_tally (int dist, int lc)
      */
 }
 
+/* ===========================================================================
+ * Return log2(X) in 1/256 bits, for 0 < X < 2**24.
+ */
+static ulg
+log2_fix (ulg x)
+{
+    int n = 0;
+    while (x >> n > 1) n++;
+    return ((ulg)n << 8)
+           + log2_frac[(n <= 8 ? x << (8 - n) : x >> (n - 8)) & 0xff];
+}
+
+/* ===========================================================================
+ * Return an estimate in 1/256 bits of the cost of coding the symbols of
+ * the N frequencies FREQ minus SUB (if not NULL) with a code of their
+ * own, including about three bits per symbol in the tree header.  The
+ * extra bits are not included, as they do not depend on the code.
+ */
+static ulg
+block_cost (ush near *freq, ush near *sub, int n)
+{
+    ulg total = 0, cost = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        ulg f = freq[i] - (sub ? sub[i] : 0);
+        if (f) {
+            total += f;
+            cost += (3 << 8) - f * log2_fix (f);
+        }
+    }
+    return total ? cost + total * log2_fix (total) : 0;
+}
+
+/* ===========================================================================
+ * Compare the cost of the current block with that of two blocks split
+ * at split_lit.  If splitting is cheaper, flush the part before
+ * split_lit and keep the rest as the current block.  Return nonzero if
+ * the block was split.
+ */
+static int
+split_block ()
+{
+    ush near cur_l[L_CODES], near cur_d[D_CODES];
+    ulg whole, first, rest; /* costs of the block and its two parts */
+    unsigned lits = last_lit, dists = last_dist, nflags = last_flags;
+    unsigned head_lits = split_lit, head_dists = split_dist;
+    unsigned head_flags = split_flags;
+    ulg in = block_in, head_in = split_in;
+    uch save_flags = flags, save_flag_bit = flag_bit;
+    int n;
+
+    for (n = 0; n < L_CODES; n++) cur_l[n] = dyn_ltree[n].Freq;
+    for (n = 0; n < D_CODES; n++) cur_d[n] = dyn_dtree[n].Freq;
+    whole = block_cost (cur_l, NULL, L_CODES) + block_cost (cur_d, NULL, D_CODES);
+    first = (block_cost (split_lfreq, NULL, L_CODES)
+             + block_cost (split_dfreq, NULL, D_CODES));
+    rest = (block_cost (cur_l, split_lfreq, L_CODES)
+            + block_cost (cur_d, split_dfreq, D_CODES));
+
+    /* Also require some gain over the fixed part of a block header. */
+    if (whole <= first + rest + (64 << 8))
+        return 0;
+
+    /* Flush the head, with the statistics it had at split_lit.  The
+     * flags after it must survive flush_block, which also resets the
+     * split_* variables.
+     */
+    for (n = 0; n < L_CODES; n++) dyn_ltree[n].Freq = split_lfreq[n];
+    for (n = 0; n < D_CODES; n++) dyn_dtree[n].Freq = split_dfreq[n];
+    last_lit = head_lits;
+    last_dist = head_dists;
+    last_flags = head_flags;
+    flags = flag_buf[head_flags];
+    flush_block (block_start >= 0L ? (char *)&window[(unsigned)block_start]
+                 : (char *)NULL, head_in, 0, 0);
+    block_start += head_in;
+
+    /* Keep the tail as the current block. */
+    for (n = 0; n < L_CODES; n++) dyn_ltree[n].Freq = cur_l[n] - split_lfreq[n];
+    for (n = 0; n < D_CODES; n++) dyn_dtree[n].Freq = cur_d[n] - split_dfreq[n];
+    dyn_ltree[END_BLOCK].Freq = 1;
+    last_lit = lits - head_lits;
+    last_dist = dists - head_dists;
+    last_flags = nflags - head_flags;
+    memmove (l_buf, l_buf + head_lits, last_lit);
+    memmove (d_buf, d_buf + head_dists, last_dist * sizeof *d_buf);
+    memmove (flag_buf, flag_buf + head_flags, last_flags);
+    flags = save_flags;
+    flag_bit = save_flag_bit;
+    block_in = in - head_in;
+    return 1;
+}
+
 /* ===========================================================================
  * Send the block data compressed using the given Huffman trees
  * LTREE is the literal tree, DTREE the distance tree.
  */
 static void
-compress_block (ct_data near *ltree, ct_data near *dtree)
+compress_block (ct_data const near *ltree, ct_data const near *dtree)
 {
     unsigned dist;      /* distance of matched string */
     int lc;             /* match length or unmatched char (if dist == 0) */
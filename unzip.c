@@ -23,13 +23,20 @@
 
 /*
    This version can extract files in gzip or pkzip format.
-   For the latter, only the first entry is extracted, and it has to be
-   either deflated or stored.
+   For the latter, entries have to be either deflated or stored.  Only
+   the first entry is extracted from a pipe; from a regular file, all
+   entries are found in the central directory, and each is extracted by
+   unzip_entry (see treat_zip_entries in gzip.c).
  */
 
 #include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include "tailor.h"
 #include "gzip.h"
+#include "xalloc.h"
 
 /* PKZIP header definitions */
 #define LOCSIG 0x04034b50L      /* four-byte lead-in (lsb first) */
@@ -47,6 +54,23 @@
 #define EXTHDR 16               /* size of extended local header, inc sig */
 #define RAND_HEAD_LEN  12       /* length of encryption random header */
 
+/* Central directory definitions */
+#define CENSIG 0x02014b50L      /* central file header signature */
+#define CENFLG 8                /* offset of bit flag */
+#define CENHOW 10               /* offset of compression method */
+#define CENLEN 24               /* offset of uncompressed length */
+#define CENNAM 28               /* offset of file name length */
+#define CENEXT 30               /* offset of extra field length */
+#define CENCOM 32               /* offset of file comment length */
+#define CENOFF 42               /* offset of local header offset */
+#define CENHDR 46               /* size of central header, including sig */
+#define ENDSIG 0x06054b50L      /* end of central directory signature */
+#define ENDTOT 10               /* offset of total number of entries */
+#define ENDSIZ 12               /* offset of central directory size */
+#define ENDOFF 16               /* offset of central directory offset */
+#define ENDHDR 22               /* size of end record, including sig */
+#define ENDMAX (ENDHDR + 0xffff) /* maximum size with a comment */
+
 
 /* Globals */
 
@@ -55,6 +79,17 @@ ulg unzip_crc;  /* CRC found by 'unzip'.  */
 static int decrypt;        /* flag to turn on decryption */
 static int pkzip = 0;      /* set for a pkzip file */
 static int ext_header = 0; /* set if extended local header */
+static int entry_mode;     /* set when extracting one of several entries */
+
+/* The entries of a pkzip file, from its central directory.  */
+struct zip_entry {
+    char *name;
+    off_t offset;          /* of the local header */
+    uch method;
+    uch flags;
+};
+static struct zip_entry *zip_entry;
+static int zip_count;
 
 /* ===========================================================================
  * Check zip file and advance inptr to the start of the compressed data.
@@ -137,7 +172,19 @@ unzip (int in, int out)
 #ifdef IBM_Z_DFLTCC
         int res = dfltcc_inflate ();
 #else
-        int res = gzip_inflate ();
+        int res;
+
+        /* With --pipeline, a child process writes the data decoded here,
+         * except when it must be hashed for a digest.  It is kept for the
+         * next members, and the caller waits for it at the end of the
+         * input.
+         */
+        if (digest_member || digest_mode == DIGEST_OUTPUT) {
+            if (coder_finish () != OK)
+                return ERROR;
+        } else if (coder_fd < 0 && coder_start () != OK)
+            return ERROR;
+        res = gzip_inflate ();
 #endif
 
         if (res == 3) {
@@ -155,9 +202,20 @@ unzip (int in, int out)
             fprintf(stderr, "len %lu, siz %lu\n", n, LG(inbuf + LOCSIZ));
             gzip_error ("invalid compressed data--length mismatch");
         }
-        while (n--) {
-            uch c = (uch)get_byte();
-            put_ubyte(c);
+        while (n) {
+            unsigned k;
+            if (inptr == insize) {
+                fill_inbuf (0);
+                inptr = 0;
+            }
+            k = insize - inptr;
+            if (WSIZE - outcnt < k) k = WSIZE - outcnt;
+            if (n < k) k = n;
+            memcpy (window + outcnt, inbuf + inptr, k);
+            inptr += k;
+            outcnt += k;
+            n -= k;
+            if (outcnt == WSIZE) flush_window ();
         }
         flush_window();
     } else {
@@ -199,9 +257,15 @@ unzip (int in, int out)
                 program_name, ifname);
         err = ERROR;
     }
+    if (digest_member && digest_check () != OK) {
+        fprintf(stderr, "\n%s: %s: invalid compressed data--digest error\n",
+                program_name, ifname);
+        err = ERROR;
+    }
 
     /* Check if there are more entries in a pkzip file */
-    if (pkzip && inptr + 4 < insize && LG(inbuf+inptr) == LOCSIG) {
+    if (pkzip && !entry_mode
+        && inptr + 4 < insize && LG(inbuf+inptr) == LOCSIG) {
         if (to_stdout) {
             WARN((stderr,
                   "%s: %s has more than one entry--rest ignored\n",
@@ -221,3 +285,129 @@ unzip (int in, int out)
     if (!test) abort_gzip();
     return err;
 }
+
+/* ===========================================================================
+ * Free the entries read by zip_entries.
+ */
+static void
+free_entries (void)
+{
+    int i;
+    for (i = 0; i < zip_count; i++)
+        free (zip_entry[i].name);
+    free (zip_entry);
+    zip_entry = NULL;
+    zip_count = 0;
+}
+
+/* ===========================================================================
+ * Done with the entries, once they are extracted.
+ */
+void
+zip_entries_free ()
+{
+    free_entries ();
+    ext_header = pkzip = 0; /* for next file */
+}
+
+/* ===========================================================================
+ * If the pkzip file IN, of size ifile_size, has more than one entry,
+ * read its central directory and return the number of entries.  Return
+ * 0 otherwise, or if the central directory cannot be used, in which
+ * case only the first entry is extracted as before.
+ */
+int
+zip_entries (int in)
+{
+    uch *end, *cen, *p;
+    off_t pos, cen_off, cen_size;
+    unsigned tail_len;
+    int total, i, n;
+
+    if (!pkzip || ifile_size < ENDHDR)
+        return 0;
+
+    /* Find the end record, which is followed only by a comment.  */
+    tail_len = ifile_size < ENDMAX ? (unsigned) ifile_size : ENDMAX;
+    pos = ifile_size - tail_len;
+    end = xmalloc (tail_len);
+    if (pread (in, end, tail_len, pos) != (ssize_t) tail_len)
+        read_error ();
+    for (p = end + tail_len - ENDHDR; end <= p; p--)
+        if (LG(p) == ENDSIG && p + ENDHDR + SH(p + ENDHDR - 2) == end + tail_len)
+            break;
+    total = end <= p ? SH(p + ENDTOT) : 0;
+    cen_size = end <= p ? LG(p + ENDSIZ) : 0;
+    cen_off = end <= p ? LG(p + ENDOFF) : 0;
+    free (end);
+
+    /* Do without archives of a single entry, spanning several disks,
+     * or in zip64 format (whose sizes do not fit in the end record).
+     */
+    if (total < 2 || total == 0xffff || cen_off == 0xffffffff
+        || ifile_size - cen_off < cen_size || cen_size < total * CENHDR)
+        return 0;
+
+    cen = xmalloc (cen_size);
+    if (pread (in, cen, cen_size, cen_off) != (ssize_t) cen_size)
+        read_error ();
+    zip_entry = xcalloc (total, sizeof *zip_entry);
+    for (p = cen, i = 0; i < total; i++) {
+        unsigned name_len;
+        if (cen + cen_size - p < CENHDR || LG(p) != CENSIG)
+            break;
+        name_len = SH(p + CENNAM);
+        n = CENHDR + name_len + SH(p + CENEXT) + SH(p + CENCOM);
+        if (cen + cen_size - p < n || memchr (p + CENHDR, 0, name_len)
+            || LG(p + CENLEN) == 0xffffffff || LG(p + CENOFF) == 0xffffffff)
+            break;
+        zip_entry[i].name = xmemdup0 (p + CENHDR, name_len);
+        zip_entry[i].offset = LG(p + CENOFF);
+        zip_entry[i].method = p[CENHOW];
+        zip_entry[i].flags = p[CENFLG];
+        zip_count = i + 1;
+        p += n;
+    }
+    free (cen);
+    if (zip_count != total) {
+        free_entries ();
+        return 0;
+    }
+    return zip_count;
+}
+
+/* ===========================================================================
+ * Return the name of entry I, or NULL if the entry is neither deflated
+ * nor stored, or is encrypted.
+ */
+char const *
+zip_entry_name (int i)
+{
+    if ((zip_entry[i].method != STORED && zip_entry[i].method != DEFLATED)
+        || (zip_entry[i].flags & CRPFLG))
+        return NULL;
+    return zip_entry[i].name;
+}
+
+/* ===========================================================================
+ * Extract entry I of the pkzip file IN to OUT.  The input is read with
+ * pread, so that several processes can share IN.
+ */
+int
+unzip_entry (int in, int out, int i)
+{
+    clear_bufs ();
+    in_offset = zip_entry[i].offset;
+    fill_inbuf (1);
+    inptr = 0;
+    if (insize < LOCHDR || LG(inbuf) != LOCSIG) {
+        fprintf (stderr, "\n%s: %s: %s: not a valid zip entry\n",
+                 program_name, ifname, zip_entry[i].name);
+        exit_code = ERROR;
+        return ERROR;
+    }
+    if (check_zipfile (in) != OK)
+        return ERROR;
+    entry_mode = 1;
+    return unzip (in, out);
+}
@@ -84,14 +84,12 @@ getcrc ()
   return crc;
 }
 
-#ifdef IBM_Z_DFLTCC
 /* Set a new CRC value.  */
 void
 setcrc (ulg c)
 {
   crc = c;
 }
-#endif
 
 /* ===========================================================================
  * Clear input and output buffers
@@ -103,6 +101,10 @@ void clear_bufs()
     bytes_in = bytes_out = 0L;
 }
 
+/* If nonnegative, fill_inbuf reads the input with pread at this offset,
+   rather than at the file offset, which other processes may share.  */
+off_t in_offset = -1;
+
 /* ===========================================================================
  * Fill the input buffer. This is called only when the buffer is empty.
  * EOF_OK is set if EOF acceptable as a result.
@@ -115,7 +117,14 @@ fill_inbuf (int eof_ok)
     /* Read as much as possible */
     insize = 0;
     do {
-        len = read_buffer (ifd, (char *) inbuf + insize, INBUFSIZ - insize);
+        if (in_offset < 0)
+          len = read_buffer (ifd, (char *) inbuf + insize, INBUFSIZ - insize);
+        else {
+          len = pread (ifd, (char *) inbuf + insize, INBUFSIZ - insize,
+                       in_offset);
+          if (0 < len)
+            in_offset += len;
+        }
         if (len == 0) break;
         if (len == -1) {
           read_error();
@@ -131,6 +140,8 @@ fill_inbuf (int eof_ok)
         read_error();
     }
     bytes_in += (off_t)insize;
+    if (background)
+        throttle (insize);
     inptr = 1;
     return inbuf[0];
 }
@@ -182,17 +193,28 @@ void flush_outbuf()
     if (outcnt == 0) return;
 
     write_buf (ofd, outbuf, outcnt);
+    verify_output ((char *) outbuf, outcnt);
     outcnt = 0;
 }
 
 /* ===========================================================================
  * Write the output window window[0..outcnt-1] and update crc and bytes_out.
- * (Used for the decompressed data only.)
+ * (Used for the decompressed data only.)  With --pipeline, wait instead
+ * for the child process to do so with the data decoded so far.
  */
 void flush_window()
 {
+    if (0 <= coder_fd && method == DEFLATED) {
+        /* With --pipeline, the window of a deflated member is written
+           by the child.  Other members are written here, after the
+           child has flushed the members before them.  */
+        inflate_flush ();
+        return;
+    }
     if (outcnt == 0) return;
     updcrc(window, outcnt);
+    if (digest_member)
+        digest_member_update (window, outcnt);
 
     write_buf (ofd, window, outcnt);
     outcnt = 0;
@@ -208,8 +230,12 @@ write_buf (int fd, voidp buf, unsigned  cnt)
     unsigned  n;
 
     bytes_out += cnt;
+    if (digest_mode == DIGEST_OUTPUT)
+      digest_update (buf, cnt);
     if (test)
       return;
+    if (background)
+      throttle (cnt);
 
     while ((n = write_buffer (fd, buf, cnt)) != cnt) {
         if (n == (unsigned)(-1)) {
@@ -40,10 +40,14 @@ zip (int in, int out)
     ush  attr = 0;          /* ascii/binary flag */
     ush  deflate_flags = 0; /* pkzip -es, -en or -ex equivalent */
     ulg  stamp;
+    int  cache_fd = cache_dir ? cache_lookup (in) : -1;
+    int  r;
 
     ifd = in;
     ofd = out;
     outcnt = 0;
+    if (verify_start () != OK)
+        return ERROR;
 
     /* Write the header to the gzip file. See algorithm.doc for the format */
 
@@ -55,6 +59,9 @@ zip (int in, int out)
     if (save_orig_name) {
         flags |= ORIG_NAME;
     }
+    if (digest_fillable (out)) {
+        flags |= EXTRA_FIELD;
+    }
     put_byte(flags);         /* general flags */
     if (time_stamp.tv_nsec < 0)
       stamp = 0;
@@ -71,6 +78,7 @@ zip (int in, int out)
 
     /* Write deflated file to zip file */
     updcrc (NULL, 0);
+    digest_start (DIGEST_INPUT);
 
     bi_init(out);
     ct_init(&attr, &method);
@@ -82,18 +90,51 @@ zip (int in, int out)
     put_byte((uch)deflate_flags); /* extra flags */
     put_byte(OS_CODE);            /* OS identifier */
 
+    if (flags & EXTRA_FIELD) {
+        digest_field ();
+    }
+
     if (save_orig_name) {
-        char *p = gzip_base_name (ifname); /* Don't save the directory part. */
+        /* Don't save the directory part. */
+        char *p = orig_name ? orig_name : gzip_base_name (ifname);
         do {
             put_byte (*p);
         } while (*p++);
     }
     header_bytes = (off_t)outcnt;
 
+    if (resuming)
+        resume_restore (in, out);
+    else if (index_interval)
+        index_start (out);
+
+    if (0 <= cache_fd) {
+        /* The cached data ends with the crc and uncompressed size.  */
+        header_bytes += 2*4;
+        return cache_copy (cache_fd, out);
+    }
+
 #ifdef IBM_Z_DFLTCC
     dfltcc_deflate (level);
 #else
+    if (coder_start () != OK)
+        return ERROR;
     gzip_deflate (level);
+
+    /* With --resumable or --access-points, each segment of the input is
+     * deflated on its own.  file_read stops at the end of the segment, and
+     * flush_block then ends the block with a sync point instead of the
+     * stream.
+     */
+    while (bytes_in == resume_next) {
+        if (resume_interval)
+            resume_checkpoint ();
+        else
+            index_point ();
+        gzip_deflate (level);
+    }
+    if (coder_finish () != OK)
+        return ERROR;
 #endif
 
 #ifndef NO_SIZE_CHECK
@@ -112,7 +153,14 @@ zip (int in, int out)
     header_bytes += 2*4;
 
     flush_outbuf();
-    return OK;
+    if (flags & EXTRA_FIELD)
+        digest_fill (out);
+    else
+        digest_finish ();
+    r = verify_finish ();
+    if (index_interval)
+        index_finish (r == OK);
+    return r;
 }
 
 
@@ -128,6 +176,10 @@ file_read (char *buf, unsigned size)
 
     Assert(insize == 0, "inbuf not empty");
 
+    if (0 <= resume_next && resume_next - bytes_in < size)
+        size = resume_next - bytes_in;
+    if (size == 0) return 0;
+
     len = read_buffer (ifd, buf, size);
     if (len == 0) return (int)len;
     if (len == (unsigned)-1) {
@@ -135,6 +187,11 @@ file_read (char *buf, unsigned size)
     }
 
     updcrc ((uch *) buf, len);
+    if (digest_mode == DIGEST_INPUT)
+        digest_update (buf, len);
     bytes_in += (off_t)len;
+    tee_input (buf, len);
+    if (background)
+        throttle (len);
     return (int)len;
 }